@@ -0,0 +1,139 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace vss {
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr size_t HUGEPAGE_SIZE = 2 << 20;
+
+inline size_t align_up(size_t bytes, size_t alignment) { return (bytes + alignment - 1) / alignment * alignment; }
+
+// 按缓存行对齐分配；大页模式下按 2MB 对齐，并建议内核用透明大页映射（仅 Linux）
+inline char* aligned_malloc(size_t bytes, bool use_hugepages = false) {
+    size_t alignment = use_hugepages ? HUGEPAGE_SIZE : CACHE_LINE_SIZE;
+    bytes = align_up(std::max<size_t>(bytes, 1), alignment);
+#ifdef _WIN32
+    return (char*)_aligned_malloc(bytes, alignment);
+#else
+    char* p = (char*)std::aligned_alloc(alignment, bytes);
+#ifdef MADV_HUGEPAGE
+    if (use_hugepages && p != nullptr) {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+#endif
+}
+
+inline void aligned_free(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// 按块分配的内存池，以 64 位偏移寻址：偏移的高位为块号，低位为块内位置。超过一块的分配占用连续的多个块号，
+// 每次分配都是一段连续内存，且按缓存行对齐。分配可以并发调用；块地址表预先分配好，按偏移取地址不需要加锁
+class ChunkedArena {
+public:
+    static constexpr size_t MAX_CHUNKS = 1 << 16;
+
+    size_t chunk_bits;
+    size_t chunk_size;
+    bool use_hugepages;
+
+    char** chunks;
+    size_t num_chunks;
+    size_t next_offset;
+    size_t used_bytes;
+
+    // 本对象分配的内存区域，析构时释放；adopt 接管的外部内存（如文件映射）不在其中
+    std::vector<char*> owned_regions;
+    std::mutex lock;
+
+    ChunkedArena(size_t chunk_bits, bool use_hugepages = false) {
+        this->chunk_bits = chunk_bits;
+        this->chunk_size = (size_t)1 << chunk_bits;
+        this->use_hugepages = use_hugepages;
+        this->chunks = new char*[MAX_CHUNKS]();
+        this->num_chunks = 0;
+        this->next_offset = 0;
+        this->used_bytes = 0;
+    }
+
+    ~ChunkedArena() {
+        for (char* region : owned_regions) {
+            aligned_free(region);
+        }
+        delete[] chunks;
+    }
+
+    inline char* addr(size_t offset) const { return chunks[offset >> chunk_bits] + (offset & (chunk_size - 1)); }
+
+    size_t allocate(size_t bytes) {
+        bytes = align_up(bytes, CACHE_LINE_SIZE);
+        std::unique_lock<std::mutex> guard(lock);
+        if (next_offset + bytes > (num_chunks << chunk_bits)) {
+            size_t n = std::max<size_t>((bytes + chunk_size - 1) >> chunk_bits, 1);
+            char* region = aligned_malloc(n << chunk_bits, use_hugepages);
+            if (region == nullptr || num_chunks + n > MAX_CHUNKS) {
+                std::cerr << "Fail to allocate arena chunk of " << (n << chunk_bits) << " bytes" << std::endl;
+                std::exit(-1);
+            }
+            owned_regions.push_back(region);
+            add_region(region, n);
+        }
+        size_t offset = next_offset;
+        next_offset += bytes;
+        used_bytes += bytes;
+        return offset;
+    }
+
+    // 与另一个内存池交换全部内容（锁除外），用于压缩：把存活的数据拷到新池后交换，旧池析构时释放
+    void swap(ChunkedArena& other) {
+        std::swap(chunk_bits, other.chunk_bits);
+        std::swap(chunk_size, other.chunk_size);
+        std::swap(use_hugepages, other.use_hugepages);
+        std::swap(chunks, other.chunks);
+        std::swap(num_chunks, other.num_chunks);
+        std::swap(next_offset, other.next_offset);
+        std::swap(used_bytes, other.used_bytes);
+        owned_regions.swap(other.owned_regions);
+    }
+
+    // 把一段外部内存接入偏移空间，返回其起始偏移；之后的分配从新的块开始
+    size_t adopt(char* region, size_t bytes) {
+        std::unique_lock<std::mutex> guard(lock);
+        size_t n = std::max<size_t>((bytes + chunk_size - 1) >> chunk_bits, 1);
+        size_t offset = add_region(region, n);
+        next_offset = num_chunks << chunk_bits;
+        used_bytes += bytes;
+        return offset;
+    }
+
+private:
+    size_t add_region(char* region, size_t n) {
+        size_t offset = num_chunks << chunk_bits;
+        for (size_t i = 0; i < n; i++) {
+            chunks[num_chunks + i] = region + (i << chunk_bits);
+        }
+        num_chunks += n;
+        next_offset = offset;
+        return offset;
+    }
+};
+
+} // namespace vss
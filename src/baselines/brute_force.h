@@ -10,12 +10,11 @@ public:
 
     void build_vectors(const float* data, int size) override {}
 
-    std::unordered_set<int> search_candidates(const float* q_data, int q_len, int q_k) override {
-        std::unordered_set<int> candidates;
+    void search_candidates(const float* q_data, int q_len, int q_k, CandidateList& candidates) override {
+        candidates.ids.resize(seq_num);
         for (int i = 0; i < seq_num; i++) {
-            candidates.insert(i);
+            candidates.ids[i] = i;
         }
-        return candidates;
     }
 };
 
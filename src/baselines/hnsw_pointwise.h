@@ -13,12 +13,13 @@ public:
     hnswlib::HierarchicalNSW<float>* hnsw;
 
     HNSWPointwiseIndex(int dim, VSSSpace* space, int M, int ef_construction)
-        : RerankIndex(dim, space), M(M), ef_construction(ef_construction) {}
+        : RerankIndex(dim, space), M(M), ef_construction(ef_construction), hnsw(nullptr) {}
 
     ~HNSWPointwiseIndex() { delete hnsw; }
 
     void build_vectors(const float* data, int size) override {
         hnsw = new hnswlib::HierarchicalNSW<float>(space->space, size, M, ef_construction);
+        hnsw->setEf(1);
 
         const float* vec = data;
         for (size_t i = 0; i < size; i++, vec += dim) {
@@ -26,21 +27,44 @@ public:
         }
     }
 
-    std::unordered_set<int> search_candidates(const float* q_data, int q_len, int q_k) override {
-        hnsw->ef_ = q_k;
-        std::unordered_set<int> candidates;
+    std::string get_build_params() const override {
+        return "-M" + std::to_string(M) + "-efc" + std::to_string(ef_construction);
+    }
+
+    bool save_vectors(const std::string& path) override {
+        hnsw->saveIndex(path);
+        return true;
+    }
 
+    // hnswlib 的格式自带参数，加载时反序列化到内存
+    bool load_vectors(const std::string& path) override {
+        hnsw = new hnswlib::HierarchicalNSW<float>(space->space, path);
+        hnsw->setEf(1);
+        return hnsw->M_ == M && hnsw->cur_element_count == vec_to_seq.size();
+    }
+
+    void search_candidates(const float* q_data, int q_len, int q_k, CandidateList& candidates) override {
+        // searchKnn 的搜索宽度为 max(ef_, k)，ef_ 在构建和加载时固定为 1，每个 token 的宽度即 q_k，查询路径上不写索引状态
         const float* q_vec = q_data;
         for (int i = 0; i < q_len; i++, q_vec += dim) {
             auto res = hnsw->searchKnn(q_vec, q_k);
+            candidates.begin_token();
+            float impute = res.empty() ? 0.0f : res.top().first;
             while (!res.empty()) {
                 auto result = res.top();
                 res.pop();
-                candidates.insert(vec_to_seq[result.second]);
+                candidates.vote(vec_to_seq[result.second], result.first);
             }
+            candidates.end_token(impute);
         }
+    }
 
-        return candidates;
+    size_t get_memory_usage() override {
+        size_t bytes = hnsw->max_elements_ * hnsw->size_data_per_element_;
+        for (int level : hnsw->element_levels_) {
+            bytes += hnsw->size_links_per_element_ * level;
+        }
+        return RerankIndex::get_memory_usage() + bytes;
     }
 };
 
@@ -2,6 +2,10 @@
 
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexIVFPQ.h>
+#include <faiss/index_io.h>
+#include <faiss/invlists/InvertedLists.h>
+
+#include <random>
 
 #include "index.h"
 
@@ -13,14 +17,36 @@ public:
     int m;      // PQ分块数
     int nbits;  // 每个子量化器bit数
     int nprobe; // 搜索时访问的倒排表数量
+    // 训练使用的随机采样向量数，0 表示用全部向量。IVFPQ 训练要把每个训练向量分配到倒排表并计算残差，
+    // 全量训练的开销与数据规模成正比，而 k-means 本身只需要每个质心几百个样本
+    int train_size;
+    // 大于 0 时投票得到的候选先用 PQ 编码上的非对称距离（ADC）近似评分，只有最好的 adc_shortlist 个读取 fp32 序列精确重排序
+    int adc_shortlist;
 
     faiss::IndexFlat* quantizer;
     faiss::IndexIVFPQ* index;
+    std::vector<std::pair<std::string, long>> build_metrics;
+
+    // ADC 用的数据：各倒排表编码的指针（直接读 faiss 持有的编码，不另存一份，析构时归还）；
+    // 按向量 id 顺序存放所属倒排表、表内位置、重建向量的模长平方；另有粗量化质心和各序列第一个向量的 id
+    std::vector<const uint8_t*> adc_list_codes;
+    std::vector<int> adc_lists;
+    std::vector<int> adc_offsets;
+    std::vector<float> adc_norms;
+    std::vector<float> coarse_centroids;
+    std::vector<size_t> seq_begin;
+
+    std::atomic<long> metric_adc_scored;
+    std::atomic<long> metric_adc_time;
 
     IVFPQPointwiseIndex(int dim, VSSSpace* space, int nlist = 100, int m = 8, int nbits = 8)
-        : RerankIndex(dim, space), nlist(nlist), m(m), nbits(nbits) {}
+        : RerankIndex(dim, space), nlist(nlist), m(m), nbits(nbits), nprobe(10), train_size(0), adc_shortlist(0),
+          quantizer(nullptr), index(nullptr), metric_adc_scored(0), metric_adc_time(0) {}
 
     ~IVFPQPointwiseIndex() {
+        for (size_t l = 0; l < adc_list_codes.size(); l++) {
+            index->invlists->release_codes(l, adc_list_codes[l]);
+        }
         delete index;
         delete quantizer;
     }
@@ -34,20 +60,281 @@ public:
             index = new faiss::IndexIVFPQ(quantizer, dim, nlist, m, nbits, faiss::METRIC_L2);
         }
 
-        index->train(size, data);
+        auto begin = std::chrono::high_resolution_clock::now();
+        if (train_size > 0 && train_size < size) {
+            // 固定种子的部分 Fisher-Yates 洗牌，取前 train_size 个向量
+            std::vector<int> ids(size);
+            for (int i = 0; i < size; i++) {
+                ids[i] = i;
+            }
+            std::mt19937 rng(100);
+            std::vector<float> sample((size_t)train_size * dim);
+            for (int i = 0; i < train_size; i++) {
+                std::swap(ids[i], ids[std::uniform_int_distribution<int>(i, size - 1)(rng)]);
+                memcpy(sample.data() + (size_t)i * dim, data + (size_t)ids[i] * dim, dim * sizeof(float));
+            }
+            index->train(train_size, sample.data());
+        } else {
+            index->train(size, data);
+        }
+        auto mid = std::chrono::high_resolution_clock::now();
         index->add(size, data);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        build_metrics = {
+            {"train_vectors", train_size > 0 ? std::min(train_size, size) : size},
+            {"train_us", std::chrono::duration_cast<std::chrono::microseconds>(mid - begin).count()},
+            {"add_us", std::chrono::duration_cast<std::chrono::microseconds>(end - mid).count()},
+        };
+        init_adc();
     }
 
-    std::unordered_set<int> search_candidates(const float* q_data, int q_len, int q_k) override {
-        index->nprobe = 10;
+    std::vector<std::pair<std::string, long>> get_build_metrics() override { return build_metrics; }
+
+    std::string get_build_params() const override {
+        std::string params = "-nlist" + std::to_string(nlist) + "-m" + std::to_string(m) + "-nbits" + std::to_string(nbits);
+        return train_size > 0 ? params + "-train" + std::to_string(train_size) : params;
+    }
+
+    bool save_vectors(const std::string& path) override {
+        faiss::write_index(index, path.c_str());
+        return true;
+    }
+
+    // 读出的索引持有自己的粗量化器，倒排表以 mmap 方式映射
+    bool load_vectors(const std::string& path) override {
+        faiss::Index* loaded = faiss::read_index(path.c_str(), faiss::IO_FLAG_MMAP);
+        index = dynamic_cast<faiss::IndexIVFPQ*>(loaded);
+        if (index == nullptr) {
+            delete loaded;
+            return false;
+        }
+        if (index->nlist != nlist || index->pq.M != m || index->pq.nbits != nbits ||
+            index->ntotal != vec_to_seq.size()) {
+            return false;
+        }
+        init_adc();
+        return true;
+    }
+
+    // 记下每个向量 id 在倒排表中的位置，评分时按位置读取 faiss 中的 PQ 编码，并预先计算重建向量的模长平方（L2 代价需要）
+    void init_adc() {
+        if (adc_shortlist <= 0) {
+            return;
+        }
+        cerr_if(index->pq.nbits != 8, "ADC rerank requires 8-bit PQ codes, got nbits=", index->pq.nbits);
+        size_t n = index->ntotal;
+        adc_list_codes.resize(index->nlist);
+        adc_lists.resize(n);
+        adc_offsets.resize(n);
+        for (size_t l = 0; l < index->nlist; l++) {
+            size_t size = index->invlists->list_size(l);
+            adc_list_codes[l] = index->invlists->get_codes(l);
+            faiss::InvertedLists::ScopedIds ids(index->invlists, l);
+            for (size_t j = 0; j < size; j++) {
+                faiss::idx_t id = ids.get()[j];
+                adc_lists[id] = l;
+                adc_offsets[id] = j;
+            }
+        }
+
+        coarse_centroids.resize((size_t)index->nlist * dim);
+        index->quantizer->reconstruct_n(0, index->nlist, coarse_centroids.data());
+
+        adc_norms.resize(n);
+#pragma omp parallel for num_threads(build_threads) schedule(static, 4096)
+        for (size_t i = 0; i < n; i++) {
+            float* recon = thread_scratch<SCRATCH_ADC>(dim);
+            index->pq.decode(adc_code(i), recon);
+            const float* centroid = coarse_centroids.data() + (size_t)adc_lists[i] * dim;
+            float norm = 0.0f;
+            for (int d = 0; d < dim; d++) {
+                float x = recon[d] + (index->by_residual ? centroid[d] : 0.0f);
+                norm += x * x;
+            }
+            adc_norms[i] = norm;
+        }
+
+        seq_begin.resize(seq_num);
+        size_t offset = 0;
+        for (int i = 0; i < seq_num; i++) {
+            seq_begin[i] = offset;
+            offset += seq_len[i];
+        }
+    }
+
+    inline const uint8_t* adc_code(size_t v) const {
+        return adc_list_codes[adc_lists[v]] + (size_t)adc_offsets[v] * index->code_size;
+    }
+
+    static inline float inner_product(const float* a, const float* b, int n) {
+        float ip = 0.0f;
+        for (int i = 0; i < n; i++) {
+            ip += a[i] * b[i];
+        }
+        return ip;
+    }
+
+    inline size_t adc_table_stride() const { return index->nlist + index->pq.M * index->pq.ksub + 1; }
+
+    // 每个查询向量一张表：与各粗量化质心的内积 (nlist)、各子空间与 PQ 码本中心的内积 (M x ksub)、模长平方
+    const float* adc_tables(const float* q_data, int q_len) const {
+        const faiss::ProductQuantizer& pq = index->pq;
+        size_t stride = adc_table_stride();
+        float* tables = thread_scratch<SCRATCH_ADC>(q_len * stride);
+        const float* q = q_data;
+        for (int i = 0; i < q_len; i++, q += dim) {
+            float* t = tables + i * stride;
+            for (size_t l = 0; l < index->nlist; l++) {
+                t[l] = index->by_residual ? inner_product(q, coarse_centroids.data() + l * dim, dim) : 0.0f;
+            }
+            float* lut = t + index->nlist;
+            for (size_t sub = 0; sub < pq.M; sub++) {
+                for (size_t c = 0; c < pq.ksub; c++) {
+                    lut[sub * pq.ksub + c] =
+                        inner_product(q + sub * pq.dsub, pq.centroids.data() + (sub * pq.ksub + c) * pq.dsub, pq.dsub);
+                }
+            }
+            t[stride - 1] = inner_product(q, q, dim);
+        }
+        return tables;
+    }
+
+    // 查表得到查询与序列 id 各向量重建值的内积，换算成逐点代价矩阵，再由 space 聚合成序列距离
+    float adc_distance(const float* tables, int q_len, int id) const {
+        size_t M = index->pq.M;
+        size_t ksub = index->pq.ksub;
+        size_t stride = adc_table_stride();
+        int len = seq_len[id];
+        bool ip = space->metric == MAXSIM;
+        float* cost = thread_scratch<SCRATCH_COST>((size_t)q_len * len);
+        for (int i = 0; i < q_len; i++) {
+            const float* t = tables + i * stride;
+            const float* lut = t + index->nlist;
+            for (int j = 0; j < len; j++) {
+                size_t v = seq_begin[id] + j;
+                const uint8_t* code = adc_code(v);
+                float dot = t[adc_lists[v]];
+                for (size_t sub = 0; sub < M; sub++) {
+                    dot += lut[sub * ksub + code[sub]];
+                }
+                cost[(size_t)i * len + j] = ip ? 1.0f - dot : std::max(t[stride - 1] + adc_norms[v] - 2.0f * dot, 0.0f);
+            }
+        }
+        return space->distance_from_costs(cost, q_len, len);
+    }
+
+    void shortlist(const float* q_data, int q_len, CandidateList& candidates) override {
+        if (adc_shortlist <= 0 || candidates.size() <= (size_t)adc_shortlist) {
+            return;
+        }
+        auto begin = std::chrono::high_resolution_clock::now();
+        const float* tables = adc_tables(q_data, q_len);
+        for (int id : candidates.ids) {
+            candidates.score[id] = adc_distance(tables, q_len, id);
+        }
+        candidates.scored = true;
+        metric_adc_scored += candidates.size();
+        candidates.truncate(adc_shortlist);
+        auto end = std::chrono::high_resolution_clock::now();
+        metric_adc_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+    }
+
+    // nprobe 通过每次检索的参数传入，并发查询不写共享的 index->nprobe
+    void search_candidates(const float* q_data, int q_len, int q_k, CandidateList& candidates) override {
+        faiss::SearchParametersIVF params;
+        params.nprobe = nprobe;
         std::vector<float> D(q_len * q_k);
         std::vector<faiss::idx_t> I(q_len * q_k);
-        index->search(q_len, q_data, q_k, D.data(), I.data());
-        std::unordered_set<int> candidates;
-        for (auto id : I) {
-            candidates.insert(vec_to_seq[id]);
+        index->search(q_len, q_data, q_k, D.data(), I.data(), &params);
+        vote_tokens(D.data(), I.data(), q_len, q_k, candidates);
+    }
+
+    // 一批查询的所有 token 拼在一起，均分成 batch_threads 段由各线程分别交给 faiss 检索（嵌套的 faiss 并行区只用一个线程，
+    // 不改动全局线程数），之后各查询按 batch_threads 个线程并发投票和重排序。faiss 检索的耗时平摊到各查询的候选生成时间
+    std::vector<std::priority_queue<std::pair<float, int>>>
+    search_batch(const std::vector<std::pair<const float*, int>>& queries, int k, int ef, int batch_threads) override {
+        std::vector<size_t> offsets(queries.size() + 1, 0);
+        for (size_t i = 0; i < queries.size(); i++) {
+            offsets[i + 1] = offsets[i] + queries[i].second;
         }
-        return candidates;
+        size_t total = offsets.back();
+        std::vector<float> tokens(total * dim);
+        for (size_t i = 0; i < queries.size(); i++) {
+            memcpy(tokens.data() + offsets[i] * dim, queries[i].first, (size_t)queries[i].second * dim * sizeof(float));
+        }
+
+        auto begin = std::chrono::high_resolution_clock::now();
+        std::vector<float> D(total * ef);
+        std::vector<faiss::idx_t> I(total * ef);
+        faiss::SearchParametersIVF params;
+        params.nprobe = nprobe;
+        int chunks = std::max(batch_threads, 1);
+        size_t chunk_size = (total + chunks - 1) / chunks;
+#pragma omp parallel for num_threads(chunks) schedule(static, 1)
+        for (int c = 0; c < chunks; c++) {
+            size_t from = std::min(total, c * chunk_size);
+            size_t to = std::min(total, from + chunk_size);
+            if (from < to) {
+                index->search(to - from, tokens.data() + from * dim, ef, D.data() + from * ef, I.data() + from * ef,
+                              &params);
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        metric_cand_gen_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+
+        std::vector<std::priority_queue<std::pair<float, int>>> results(queries.size());
+#pragma omp parallel for num_threads(batch_threads) schedule(dynamic, 1)
+        for (size_t i = 0; i < queries.size(); i++) {
+            auto begin = std::chrono::high_resolution_clock::now();
+            CandidateList& candidates = *candidate_pool->get();
+            candidates.reset();
+            vote_tokens(D.data() + offsets[i] * ef, I.data() + offsets[i] * ef, queries[i].second, ef, candidates);
+            results[i] = rerank(queries[i].first, queries[i].second, k, candidates, begin);
+        }
+        return results;
+    }
+
+    // 每个 token 的 q_k 个结果按行存放在 D / I 中
+    inline void vote_tokens(const float* D, const faiss::idx_t* I, int q_len, int q_k, CandidateList& candidates) {
+        // 内积度量下 faiss 返回相似度，换算成与 hnswlib 一致的 1 - ip
+        bool ip = space->metric == MAXSIM;
+        for (int i = 0; i < q_len; i++) {
+            candidates.begin_token();
+            // 与 SingleHNSWIndex::vote_token 一致，impute 取有效结果中的最大距离，没有结果时为 0
+            int voted = 0;
+            float impute = 0.0f;
+            for (int j = i * q_k; j < (i + 1) * q_k; j++) {
+                if (I[j] < 0) {
+                    continue;
+                }
+                float dist = ip ? 1.0f - D[j] : D[j];
+                impute = voted++ == 0 ? dist : std::max(impute, dist);
+                candidates.vote(vec_to_seq[I[j]], dist);
+            }
+            candidates.end_token(impute);
+        }
+    }
+
+    std::vector<std::pair<std::string, long>> get_metrics() override {
+        auto metrics = RerankIndex::get_metrics();
+        metrics.push_back({"adc_scored", metric_adc_scored});
+        metrics.push_back({"adc_time", metric_adc_time});
+        return metrics;
+    }
+
+    void reset_metrics() override {
+        RerankIndex::reset_metrics();
+        metric_adc_scored = 0;
+        metric_adc_time = 0;
+    }
+
+    size_t get_memory_usage() override {
+        size_t bytes = index->ntotal * (index->code_size + sizeof(faiss::idx_t));
+        bytes += adc_list_codes.size() * sizeof(uint8_t*) + (adc_lists.size() + adc_offsets.size()) * sizeof(int) +
+                 adc_norms.size() * sizeof(float) + coarse_centroids.size() * sizeof(float);
+        bytes += (size_t)nlist * dim * sizeof(float) + ((size_t)1 << nbits) * dim * sizeof(float);
+        return RerankIndex::get_memory_usage() + bytes;
     }
 };
 
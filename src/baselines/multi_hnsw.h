@@ -1,6 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+
+#include "arena.h"
+#include "mmap_file.h"
+#include "pair_cache.h"
 #include "space.h"
+#include "visited_list.h"
 
 namespace vss {
 
@@ -9,63 +16,73 @@ typedef unsigned int linklist_t;
 
 class MultiHNSW {
 public:
-    class VisitedList {
-    public:
-        typedef unsigned short tag_t;
-
-        size_t num_elements;
-        tag_t tag;
-        tag_t* mass;
-
-        VisitedList(size_t num_elements) : num_elements(num_elements), tag(-1), mass(new tag_t[num_elements]) {}
-
-        inline void reset() {
-            tag++;
-            if (tag == 0) {
-                tag = 1;
-                memset(mass, 0, sizeof(tag_t) * num_elements);
-            }
-        }
-
-        inline void visit(id_t id) { mass[id] = tag; }
-
-        inline bool is_visited(id_t id) const { return mass[id] == tag; }
-
-        ~VisitedList() { delete[] mass; }
-    };
-
     VSSSpace* space;
+    const ScalarQuantizer* quantizer;
+    size_t vector_size;
 
     size_t max_elements;
-    size_t cur_elements;
+    std::atomic<size_t> cur_elements;
 
     size_t M;
     size_t max_M;
     size_t max_M0;
     size_t ef_construction;
-    size_t ef;
 
     int max_level;
     id_t enterpoint;
-    VisitedList* visited_list;
+    VisitedListPool* visited_list_pool;
+
+    // 并发构建：每个元素的邻接表各有一把锁，全局锁只在可能更新入口点和最高层时持有
+    std::vector<std::mutex> link_list_locks;
+    std::mutex global_lock;
 
     size_t size_links_level;
     size_t size_links_level0;
 
-    std::vector<char*> elements;
-    std::vector<char*> linklists;
+    // 第 0 层邻接表按 id 连续存放在一个对齐数组中；序列数据和上层邻接表分别放在按块分配的内存池里，按偏移寻址
+    char* links0;
+    bool links0_owned;
+    ChunkedArena data_arena;
+    ChunkedArena link_arena;
+    std::vector<size_t> data_offsets;
+    std::vector<size_t> link_offsets;
     std::vector<int> element_lens;
     std::vector<int> element_levels;
 
+    // 两阶段评估用的序列摘要：每个序列按位置均分为至多 proxy_segments 段，各段取均值向量。
+    // proxy_ratio < 1 时查询扩展一个节点时先按摘要上的代理距离给未访问的邻居排序，只对前 proxy_ratio 比例计算精确距离
+    int proxy_segments;
+    float proxy_ratio;
+    std::vector<float> proxies;
+    std::vector<int> proxy_lens;
+
+    // 构建期间的序列对距离缓存，由索引在构建前创建、构建后释放
+    PairDistanceCache* pair_cache;
+
+    // 删除标记：0 存活，1 已删除（仍参与图上的路由），2 已删除且已在 repair_deleted 中从图中摘除
+    std::vector<char> element_deleted;
+    size_t num_deleted;
+    // 已摘除元素在两个内存池中仍占用的字节数，超过已用量的 1/COMPACT_RATIO 时压缩
+    size_t dead_bytes;
+    static constexpr size_t COMPACT_RATIO = 4;
+
     std::default_random_engine level_generator;
     std::default_random_engine update_probability_generator;
 
-    long metric_distance_computations;
-    long metric_hops;
+    // load 之后第 0 层邻接表和两个内存池的第一段都指向文件映射，之后插入的元素从新的块分配
+    MappedFile mapped_file;
+
+    // 并发查询时每个查询先在局部计数，结束时一次性累加
+    std::atomic<long> metric_distance_computations;
+    std::atomic<long> metric_proxy_computations;
+    std::atomic<long> metric_hops;
 
     MultiHNSW(VSSSpace* space, size_t max_elements, size_t M = 16, size_t ef_construction = 200,
-              size_t random_seed = 100) {
+              size_t random_seed = 100, const ScalarQuantizer* quantizer = nullptr, bool use_hugepages = false)
+        : data_arena(26, use_hugepages), link_arena(22, use_hugepages) {
         this->space = space;
+        this->quantizer = quantizer;
+        this->vector_size = quantizer ? quantizer->code_size : space->data_size;
 
         this->max_elements = max_elements;
         this->cur_elements = 0;
@@ -74,35 +91,189 @@ public:
         this->max_M = M;
         this->max_M0 = M * 2;
         this->ef_construction = std::max(ef_construction, M);
-        this->ef = 10;
 
         this->max_level = -1;
         this->enterpoint = -1;
-        this->visited_list = new VisitedList(max_elements);
+        this->visited_list_pool = new VisitedListPool(max_elements);
+        this->link_list_locks = std::vector<std::mutex>(max_elements);
 
         this->size_links_level = sizeof(linklist_t) + max_M * sizeof(id_t);
         this->size_links_level0 = sizeof(linklist_t) + max_M0 * sizeof(id_t);
 
-        this->elements.resize(max_elements);
-        this->linklists.resize(max_elements);
+        this->links0 = aligned_malloc(max_elements * size_links_level0, use_hugepages);
+        this->links0_owned = true;
+        this->data_offsets.resize(max_elements);
+        this->link_offsets.resize(max_elements);
         this->element_lens.resize(max_elements);
         this->element_levels.resize(max_elements);
+        this->element_deleted.resize(max_elements);
+        this->num_deleted = 0;
+        this->dead_bytes = 0;
+        this->proxy_segments = 0;
+        this->proxy_ratio = 1.0f;
+        this->pair_cache = nullptr;
 
         this->level_generator.seed(random_seed);
         this->update_probability_generator.seed(random_seed + 1);
 
+        // 层数按元素 id 预先生成，与插入顺序无关；批量构建见 add_points
+        for (size_t i = 0; i < max_elements; i++) {
+            this->element_levels[i] = get_random_level();
+        }
+
         this->metric_distance_computations = 0;
+        this->metric_proxy_computations = 0;
         this->metric_hops = 0;
     }
 
     ~MultiHNSW() {
-        free(visited_list);
+        delete visited_list_pool;
+        if (links0_owned) {
+            aligned_free(links0);
+        }
+    }
+
+    static constexpr uint64_t FILE_MAGIC = 0x57534e4848544d56; // "VMTHHNSW"
+
+    // 文件布局：参数头 | 各元素序列长度 | 各元素层数 | 删除标记 | 第 0 层邻接表 | 序列数据 | 各元素上层邻接表
+    // 后三段各自按缓存行对齐，序列数据按构建时的存储方式（fp32 或量化编码）存放，每个序列补齐到缓存行。
+    // 内存池中的偏移不写入文件，加载时按长度和层数重新计算
+    void save(const std::string& location) const {
+        std::ofstream out(location, std::ios::binary);
+        write_pod(out, FILE_MAGIC);
+        write_pod(out, INDEX_FILE_VERSION);
+        for (uint64_t v : {(uint64_t)vector_size, (uint64_t)cur_elements, (uint64_t)M, (uint64_t)max_M,
+                           (uint64_t)max_M0, (uint64_t)ef_construction, (uint64_t)(int64_t)max_level,
+                           (uint64_t)enterpoint, (uint64_t)size_links_level, (uint64_t)size_links_level0}) {
+            write_pod(out, v);
+        }
+        out.write((const char*)element_lens.data(), cur_elements * sizeof(int));
+        out.write((const char*)element_levels.data(), cur_elements * sizeof(int));
+        out.write(element_deleted.data(), cur_elements);
+        pad_to_cache_line(out);
+        out.write(links0, cur_elements * size_links_level0);
+        pad_to_cache_line(out);
+        for (id_t i = 0; i < cur_elements; i++) {
+            out.write(addr_data(i), vector_size * element_lens[i]);
+            pad_to_cache_line(out);
+        }
         for (id_t i = 0; i < cur_elements; i++) {
-            free(elements[i]);
             if (element_levels[i] > 0) {
-                free(linklists[i]);
+                out.write((const char*)addr_link_level(i, 1), size_links_level * element_levels[i]);
+                pad_to_cache_line(out);
+            }
+        }
+    }
+
+    static void pad_to_cache_line(std::ostream& out) {
+        static const char zeros[CACHE_LINE_SIZE] = {};
+        size_t pos = out.tellp();
+        out.write(zeros, align_up(pos, CACHE_LINE_SIZE) - pos);
+    }
+
+    // 加载 save 写出的文件，元素块和邻接表直接指向映射而不拷贝；加载后容量即已有元素数，继续插入时扩容
+    bool load(const std::string& location) {
+        if (!mapped_file.open(location)) {
+            return false;
+        }
+        const char* cur = mapped_file.data;
+        const char* end = mapped_file.data + mapped_file.size;
+
+        uint64_t header[12];
+        for (uint64_t& v : header) {
+            if (!read_pod(cur, end, v)) {
+                mapped_file.close();
+                return false;
             }
         }
+        size_t n = header[3];
+        size_t meta_bytes = n * 2 * sizeof(int) + n;
+        if (header[0] != FILE_MAGIC || header[1] != INDEX_FILE_VERSION || header[2] != vector_size ||
+            cur + meta_bytes > end) {
+            mapped_file.close();
+            return false;
+        }
+        const int* lens = (const int*)cur;
+        const int* levels = lens + n;
+        const char* deleted = (const char*)(levels + n);
+
+        size_t links0_begin = align_up(cur - mapped_file.data + meta_bytes, CACHE_LINE_SIZE);
+        size_t data_begin = align_up(links0_begin + n * header[11], CACHE_LINE_SIZE);
+        size_t data_bytes = 0, link_bytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            data_bytes += align_up(vector_size * lens[i], CACHE_LINE_SIZE);
+            link_bytes += align_up(header[10] * levels[i], CACHE_LINE_SIZE);
+        }
+        if (data_begin + data_bytes + link_bytes != mapped_file.size) {
+            mapped_file.close();
+            return false;
+        }
+
+        delete visited_list_pool;
+        aligned_free(links0);
+
+        this->max_elements = n;
+        this->cur_elements = n;
+        this->M = header[4];
+        this->max_M = header[5];
+        this->max_M0 = header[6];
+        this->ef_construction = header[7];
+        this->max_level = (int)(int64_t)header[8];
+        this->enterpoint = header[9];
+        this->size_links_level = header[10];
+        this->size_links_level0 = header[11];
+
+        this->element_lens.assign(lens, lens + n);
+        this->element_levels.assign(levels, levels + n);
+        this->element_deleted.assign(deleted, deleted + n);
+        this->num_deleted = n - std::count(deleted, deleted + n, 0);
+        this->dead_bytes = 0;
+
+        this->links0 = mapped_file.data + links0_begin;
+        this->links0_owned = false;
+
+        size_t data_offset = data_arena.adopt(mapped_file.data + data_begin, data_bytes);
+        size_t link_offset = link_arena.adopt(mapped_file.data + data_begin + data_bytes, link_bytes);
+        this->data_offsets.resize(n);
+        this->link_offsets.resize(n);
+        for (id_t i = 0; i < n; i++) {
+            data_offsets[i] = data_offset;
+            data_offset += align_up(vector_size * element_lens[i], CACHE_LINE_SIZE);
+            link_offsets[i] = link_offset;
+            link_offset += align_up(size_links_level * element_levels[i], CACHE_LINE_SIZE);
+        }
+
+        this->visited_list_pool = new VisitedListPool(n);
+        this->link_list_locks = std::vector<std::mutex>(n);
+        return true;
+    }
+
+    // 扩容到 new_max 个元素，新 id 的层数接着预先生成；不能与插入或查询并发调用
+    void resize(size_t new_max) {
+        char* new_links0 = aligned_malloc(new_max * size_links_level0, data_arena.use_hugepages);
+        memcpy(new_links0, links0, cur_elements * size_links_level0);
+        if (links0_owned) {
+            aligned_free(links0);
+        }
+        links0 = new_links0;
+        links0_owned = true;
+        data_offsets.resize(new_max);
+        link_offsets.resize(new_max);
+        if (proxy_segments > 0) {
+            proxies.resize(new_max * proxy_segments * space->dim);
+            proxy_lens.resize(new_max);
+        }
+        element_lens.resize(new_max);
+        element_levels.resize(new_max);
+        element_deleted.resize(new_max);
+        for (size_t i = max_elements; i < new_max; i++) {
+            element_levels[i] = get_random_level();
+        }
+
+        link_list_locks = std::vector<std::mutex>(new_max);
+        delete visited_list_pool;
+        visited_list_pool = new VisitedListPool(new_max);
+        max_elements = new_max;
     }
 
     inline int get_random_level() {
@@ -111,12 +282,13 @@ public:
         return (int)r;
     }
 
-    inline linklist_t* addr_link_level0(id_t id) const { return (linklist_t*)elements[id]; }
+    inline linklist_t* addr_link_level0(id_t id) const { return (linklist_t*)(links0 + id * size_links_level0); }
 
-    inline float* addr_data(id_t id) const { return (float*)(elements[id] + size_links_level0); }
+    // 量化存储时为编码，否则为 fp32 向量
+    inline char* addr_data(id_t id) const { return data_arena.addr(data_offsets[id]); }
 
     inline linklist_t* addr_link_level(id_t id, int level) const {
-        return (linklist_t*)(linklists[id] + (level - 1) * size_links_level);
+        return (linklist_t*)(link_arena.addr(link_offsets[id]) + (level - 1) * size_links_level);
     }
 
     inline linklist_t* addr_linklist(id_t id, int level) const {
@@ -129,29 +301,137 @@ public:
 
     inline void set_ll_size(linklist_t* ll, int size) { *((int*)ll) = size; }
 
+    // fp32 查询序列到元素的距离，量化存储时为非对称距离
+    inline float distance_to(const float* q_data, int q_len, id_t id,
+                             float bound = std::numeric_limits<float>::infinity()) const {
+        if (quantizer) {
+            return space->distance_quantized(q_data, q_len, (const uint8_t*)addr_data(id), element_lens[id], quantizer,
+                                             bound);
+        }
+        return space->distance_bounded(q_data, q_len, (const float*)addr_data(id), element_lens[id], bound);
+    }
+
+    // 两个元素之间的距离。构建期间设置了 pair_cache 时先查缓存，DTW 对称，按较小 id 在前的顺序作键
+    inline float distance_between(id_t id1, id_t id2, float bound = std::numeric_limits<float>::infinity()) const {
+        if (pair_cache == nullptr) {
+            return compute_distance_between(id1, id2, bound);
+        }
+        if (space->metric == DTW && id1 > id2) {
+            std::swap(id1, id2);
+        }
+        uint64_t key = PairDistanceCache::pair_key(id1, id2);
+        float dist;
+        if (pair_cache->lookup(key, bound, dist)) {
+            return dist;
+        }
+        dist = compute_distance_between(id1, id2, bound);
+        if (dist <= bound) {
+            pair_cache->insert(key, dist, true);
+        } else {
+            pair_cache->insert(key, bound, false);
+        }
+        return dist;
+    }
+
+    // 量化存储时先解码其中一个
+    inline float compute_distance_between(id_t id1, id_t id2, float bound) const {
+        if (quantizer) {
+            float* seq1 = thread_scratch<SCRATCH_DECODE_QUERY>((size_t)element_lens[id1] * space->dim);
+            quantizer->decode((const uint8_t*)addr_data(id1), seq1, element_lens[id1]);
+            return distance_to(seq1, element_lens[id1], id2, bound);
+        }
+        return distance_to((const float*)addr_data(id1), element_lens[id1], id2, bound);
+    }
+
+    inline const float* addr_proxy(id_t id) const { return proxies.data() + (size_t)id * proxy_segments * space->dim; }
+
+    void compute_proxy(id_t id, const float* data, int len) {
+        int dim = space->dim;
+        int segments = std::min(len, proxy_segments);
+        float* proxy = proxies.data() + (size_t)id * proxy_segments * dim;
+        std::fill(proxy, proxy + (size_t)segments * dim, 0.0f);
+        for (int j = 0; j < segments; j++) {
+            int begin = (long)j * len / segments;
+            int end = (long)(j + 1) * len / segments;
+            for (int i = begin; i < end; i++) {
+                for (int d = 0; d < dim; d++) {
+                    proxy[j * dim + d] += data[(size_t)i * dim + d];
+                }
+            }
+            for (int d = 0; d < dim; d++) {
+                proxy[j * dim + d] /= end - begin;
+            }
+        }
+        proxy_lens[id] = segments;
+    }
+
+    // 为已有元素计算摘要，之后插入的元素在 fill_element 中计算；量化存储时先解码
+    void build_proxies(int segments, int num_threads = 1) {
+        proxy_segments = segments;
+        proxies.assign(max_elements * segments * space->dim, 0.0f);
+        proxy_lens.assign(max_elements, 0);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 64)
+        for (id_t id = 0; id < cur_elements; id++) {
+            const float* data = (const float*)addr_data(id);
+            if (quantizer) {
+                float* decoded = thread_scratch<SCRATCH_DECODE_QUERY>((size_t)element_lens[id] * space->dim);
+                quantizer->decode((const uint8_t*)addr_data(id), decoded, element_lens[id]);
+                data = decoded;
+            }
+            compute_proxy(id, data, element_lens[id]);
+        }
+    }
+
+    inline float proxy_distance(const float* q_data, int q_len, id_t id) const {
+        return space->distance(q_data, q_len, addr_proxy(id), proxy_lens[id]);
+    }
+
+    size_t memory_usage() const {
+        return max_elements * size_links_level0 + data_arena.used_bytes + link_arena.used_bytes +
+               (data_offsets.size() + link_offsets.size()) * sizeof(size_t) +
+               (element_lens.size() + element_levels.size()) * sizeof(int) + element_deleted.size() +
+               max_elements * sizeof(unsigned short) + proxies.size() * sizeof(float) + proxy_lens.size() * sizeof(int);
+    }
+
+    // 构建时邻接表可能被其他线程修改，在锁内拷贝一份，距离计算不持锁
+    inline int copy_neighbors(id_t id, int level, id_t* buffer) {
+        std::unique_lock<std::mutex> lock(link_list_locks[id]);
+        linklist_t* ll = addr_linklist(id, level);
+        int size = get_ll_size(ll);
+        memcpy(buffer, get_ll_neighbors(ll), size * sizeof(id_t));
+        return size;
+    }
+
     template<bool is_search>
-    id_t search_down_to_level(id_t ep_id, const float* q_data, int q_len, int level) {
+    id_t search_down_to_level(id_t ep_id, const float* q_data, int q_len, int top_level, int level) {
+        long hops = 0;
+        long distance_computations = 0;
+        std::vector<id_t> buffer(is_search ? 0 : max_M0);
         id_t cur_id = ep_id;
-        float cur_dist = space->distance(q_data, q_len, addr_data(cur_id), element_lens[cur_id]);
-        for (int lev = max_level; lev > level; lev--) {
+        float cur_dist = distance_to(q_data, q_len, cur_id);
+        for (int lev = top_level; lev > level; lev--) {
             bool changed = true;
             while (changed) {
                 changed = false;
 
-                linklist_t* ll = addr_linklist(cur_id, lev);
-                int size = get_ll_size(ll);
-                id_t* neighbors = get_ll_neighbors(ll);
-
+                int size;
+                id_t* neighbors;
                 if (is_search) {
-                    metric_hops++;
+                    linklist_t* ll = addr_linklist(cur_id, lev);
+                    size = get_ll_size(ll);
+                    neighbors = get_ll_neighbors(ll);
+                    hops++;
+                } else {
+                    size = copy_neighbors(cur_id, lev, buffer.data());
+                    neighbors = buffer.data();
                 }
 
                 for (int i = 0; i < size; i++) {
                     id_t nei_id = neighbors[i];
-                    float d = space->distance(q_data, q_len, addr_data(nei_id), element_lens[nei_id]);
+                    float d = distance_to(q_data, q_len, nei_id, cur_dist);
 
                     if (is_search) {
-                        metric_distance_computations += q_len * element_lens[nei_id];
+                        distance_computations += q_len * element_lens[nei_id];
                     }
 
                     if (d < cur_dist) {
@@ -162,20 +442,36 @@ public:
                 }
             }
         }
+
+        if (is_search) {
+            metric_hops.fetch_add(hops, std::memory_order_relaxed);
+            metric_distance_computations.fetch_add(distance_computations, std::memory_order_relaxed);
+        }
         return cur_id;
     }
 
     template<bool is_search>
-    std::priority_queue<std::pair<float, id_t>> search_level(id_t ep_id, const float* q_data, int q_len, int level) {
+    std::priority_queue<std::pair<float, id_t>> search_level(id_t ep_id, const float* q_data, int q_len, int level,
+                                                             size_t ef_) {
+        long hops = 0;
+        long distance_computations = 0;
+        long proxy_computations = 0;
+        bool screen = is_search && proxy_ratio < 1.0f && proxy_segments > 0;
+        std::vector<id_t> buffer(is_search && !screen ? 0 : max_M0);
+        std::vector<std::pair<float, id_t>> screened;
+        VisitedList* visited_list = visited_list_pool->get();
         visited_list->reset();
         std::priority_queue<std::pair<float, id_t>> top_candidates;
         std::priority_queue<std::pair<float, id_t>> candidate_set;
-        float lower_bound = space->distance(q_data, q_len, addr_data(ep_id), element_lens[ep_id]);
+        float lower_bound = distance_to(q_data, q_len, ep_id);
         top_candidates.emplace(lower_bound, ep_id);
         candidate_set.emplace(-lower_bound, ep_id);
         visited_list->visit(ep_id);
+        if (element_deleted[ep_id]) {
+            top_candidates.pop();
+            lower_bound = std::numeric_limits<float>::infinity();
+        }
 
-        size_t ef_ = is_search ? ef : ef_construction;
         while (!candidate_set.empty()) {
             auto [cur_dist, cur_id] = candidate_set.top();
             if (-cur_dist > lower_bound && top_candidates.size() >= ef_) {
@@ -183,12 +479,33 @@ public:
             }
             candidate_set.pop();
 
-            linklist_t* ll = addr_linklist(cur_id, level);
-            int size = get_ll_size(ll);
-            id_t* neighbors = get_ll_neighbors(ll);
-
+            int size;
+            id_t* neighbors;
             if (is_search) {
-                metric_hops++;
+                linklist_t* ll = addr_linklist(cur_id, level);
+                size = get_ll_size(ll);
+                neighbors = get_ll_neighbors(ll);
+                hops++;
+            } else {
+                size = copy_neighbors(cur_id, level, buffer.data());
+                neighbors = buffer.data();
+            }
+
+            // 被筛掉的邻居不标记为已访问，之后经由其他节点扩展时还会再参与筛选
+            if (screen) {
+                screened.clear();
+                for (int i = 0; i < size; i++) {
+                    if (!visited_list->is_visited(neighbors[i])) {
+                        screened.emplace_back(proxy_distance(q_data, q_len, neighbors[i]), neighbors[i]);
+                        proxy_computations += q_len * proxy_lens[neighbors[i]];
+                    }
+                }
+                size = std::ceil(screened.size() * proxy_ratio);
+                std::nth_element(screened.begin(), screened.begin() + size, screened.end());
+                for (int i = 0; i < size; i++) {
+                    buffer[i] = screened[i].second;
+                }
+                neighbors = buffer.data();
             }
 
             for (int i = 0; i < size; i++) {
@@ -198,23 +515,35 @@ public:
                 }
                 visited_list->visit(nei_id);
 
-                float dist = space->distance(q_data, q_len, addr_data(nei_id), element_lens[nei_id]);
+                float bound = top_candidates.size() < ef_ ? std::numeric_limits<float>::infinity() : lower_bound;
+                float dist = distance_to(q_data, q_len, nei_id, bound);
 
                 if (is_search) {
-                    metric_distance_computations += q_len * element_lens[nei_id];
+                    distance_computations += q_len * element_lens[nei_id];
                 }
 
+                // 已删除的元素仍用于扩展搜索，但不进入结果
                 if (top_candidates.size() < ef_ || dist < lower_bound) {
                     candidate_set.emplace(-dist, nei_id);
-                    top_candidates.emplace(dist, nei_id);
+                    if (!element_deleted[nei_id]) {
+                        top_candidates.emplace(dist, nei_id);
+                    }
                     if (top_candidates.size() > ef_) {
                         top_candidates.pop();
                     }
-                    lower_bound = top_candidates.top().first;
+                    if (!top_candidates.empty()) {
+                        lower_bound = top_candidates.top().first;
+                    }
                 }
             }
         }
 
+        visited_list_pool->release(visited_list);
+        if (is_search) {
+            metric_hops.fetch_add(hops, std::memory_order_relaxed);
+            metric_distance_computations.fetch_add(distance_computations, std::memory_order_relaxed);
+            metric_proxy_computations.fetch_add(proxy_computations, std::memory_order_relaxed);
+        }
         return top_candidates;
     }
 
@@ -237,8 +566,7 @@ public:
             queue_closest.pop();
             bool good = true;
             for (auto& [_, other_id] : return_list) {
-                float dist = space->distance(addr_data(cur_id), element_lens[cur_id], addr_data(other_id),
-                                             element_lens[other_id]);
+                float dist = distance_between(cur_id, other_id, -cur_dist);
                 if (dist < -cur_dist) {
                     good = false;
                     break;
@@ -254,19 +582,17 @@ public:
         }
     }
 
-    id_t mutually_connect_new_element(id_t cur_id, std::priority_queue<std::pair<float, id_t>>& top_candidates,
-                                      int level) {
+    // 从候选中启发式选出新元素的邻居写入其邻接表，返回最近的邻居作为下一层的入口点
+    id_t select_neighbors(id_t cur_id, std::priority_queue<std::pair<float, id_t>>& top_candidates, int level,
+                          std::vector<id_t>& selected_neighbors) {
         get_neighbors_by_heuristic2(cur_id, top_candidates, M);
 
-        std::vector<id_t> selected_neighbors;
-        selected_neighbors.reserve(M);
+        selected_neighbors.clear();
         while (!top_candidates.empty()) {
             selected_neighbors.push_back(top_candidates.top().second);
             top_candidates.pop();
         }
 
-        id_t next_id = selected_neighbors.back();
-
         linklist_t* ll = addr_linklist(cur_id, level);
         set_ll_size(ll, selected_neighbors.size());
         id_t* neighbors = get_ll_neighbors(ll);
@@ -276,84 +602,347 @@ public:
             assert(selected_neighbors[i] != cur_id);
             neighbors[i] = selected_neighbors[i];
         }
+        return selected_neighbors.back();
+    }
 
+    // 把 n 个新元素追加到 nei_id 的邻接表，超出容量时对原有邻居和新元素一起做启发式裁剪；调用者保证没有其他线程同时改写该表
+    void connect_back(id_t nei_id, const id_t* new_ids, int n, int level) {
         size_t level_M = level == 0 ? max_M0 : max_M;
-        for (int i = 0; i < selected_neighbors.size(); i++) {
-            id_t nei_id = selected_neighbors[i];
-
-            linklist_t* nei_ll = addr_linklist(nei_id, level);
-            int nei_size = get_ll_size(nei_ll);
-            id_t* nei_neighbors = get_ll_neighbors(nei_ll);
+        linklist_t* nei_ll = addr_linklist(nei_id, level);
+        int nei_size = get_ll_size(nei_ll);
+        id_t* nei_neighbors = get_ll_neighbors(nei_ll);
+
+        assert(nei_size <= level_M);
+        if (nei_size + n <= level_M) {
+            memcpy(nei_neighbors + nei_size, new_ids, n * sizeof(id_t));
+            set_ll_size(nei_ll, nei_size + n);
+            return;
+        }
 
-            assert(nei_size <= level_M);
-            if (nei_size < level_M) {
-                set_ll_size(nei_ll, nei_size + 1);
-                nei_neighbors[nei_size] = cur_id;
-            } else {
-                std::priority_queue<std::pair<float, id_t>> candidates;
-                float dist =
-                    space->distance(addr_data(nei_id), element_lens[nei_id], addr_data(cur_id), element_lens[cur_id]);
-                candidates.emplace(dist, cur_id);
-                for (int j = 0; j < nei_size; j++) {
-                    dist = space->distance(addr_data(nei_id), element_lens[nei_id], addr_data(nei_neighbors[j]),
-                                           element_lens[nei_neighbors[j]]);
-                    candidates.emplace(dist, nei_neighbors[j]);
-                }
-                get_neighbors_by_heuristic2(nei_id, candidates, level_M);
+        std::priority_queue<std::pair<float, id_t>> candidates;
+        for (int j = 0; j < n; j++) {
+            candidates.emplace(distance_between(nei_id, new_ids[j]), new_ids[j]);
+        }
+        for (int j = 0; j < nei_size; j++) {
+            candidates.emplace(distance_between(nei_id, nei_neighbors[j]), nei_neighbors[j]);
+        }
+        get_neighbors_by_heuristic2(nei_id, candidates, level_M);
 
-                nei_size = 0;
-                while (!candidates.empty()) {
-                    nei_neighbors[nei_size++] = candidates.top().second;
-                    candidates.pop();
-                }
-                set_ll_size(nei_ll, nei_size);
-            }
+        nei_size = 0;
+        while (!candidates.empty()) {
+            nei_neighbors[nei_size++] = candidates.top().second;
+            candidates.pop();
         }
+        set_ll_size(nei_ll, nei_size);
+    }
 
+    id_t mutually_connect_new_element(id_t cur_id, std::priority_queue<std::pair<float, id_t>>& top_candidates,
+                                      int level) {
+        std::vector<id_t> selected_neighbors;
+        id_t next_id = select_neighbors(cur_id, top_candidates, level, selected_neighbors);
+        for (id_t nei_id : selected_neighbors) {
+            std::unique_lock<std::mutex> lock(link_list_locks[nei_id]);
+            connect_back(nei_id, &cur_id, 1, level);
+        }
         return next_id;
     }
 
-    void add_point(const float* data, int len, id_t vid) {
-        id_t cur_id = vid;
+    // 为元素分配序列数据和上层邻接表的空间；内存池的分配顺序决定偏移，批量插入时按 id 顺序串行调用
+    void allocate_element(id_t cur_id, int len) {
         cur_elements++;
-        int cur_level = get_random_level();
-        element_levels[cur_id] = cur_level;
         element_lens[cur_id] = len;
+        data_offsets[cur_id] = data_arena.allocate(vector_size * len);
+        if (element_levels[cur_id] > 0) {
+            link_offsets[cur_id] = link_arena.allocate(size_links_level * element_levels[cur_id]);
+        }
+    }
 
-        elements[cur_id] = (char*)malloc(size_links_level0 + space->data_size * len);
-        memcpy(addr_data(cur_id), data, space->data_size * len);
+    // 写入序列数据和摘要并清空邻接表
+    void fill_element(id_t cur_id, const float* data, int len) {
+        memset(addr_link_level0(cur_id), 0, size_links_level0);
+        if (quantizer) {
+            quantizer->encode(data, (uint8_t*)addr_data(cur_id), len);
+        } else {
+            memcpy(addr_data(cur_id), data, space->data_size * len);
+        }
+        if (proxy_segments > 0) {
+            compute_proxy(cur_id, data, len);
+        }
+        if (element_levels[cur_id] > 0) {
+            memset(addr_link_level(cur_id, 1), 0, size_links_level * element_levels[cur_id]);
+        }
+    }
 
-        if (cur_level > 0) {
-            linklists[cur_id] = (char*)malloc(size_links_level * cur_level);
-            memset(linklists[cur_id], 0, size_links_level * cur_level);
+    // 可并发调用，插入期间持有新元素自身的锁，其他线程在其连入图之前不会访问它
+    void add_point(const float* data, int len, id_t vid) {
+        id_t cur_id = vid;
+        int cur_level = element_levels[cur_id];
+        std::unique_lock<std::mutex> lock_el(link_list_locks[cur_id]);
+        allocate_element(cur_id, len);
+        fill_element(cur_id, data, len);
+
+        std::unique_lock<std::mutex> lock_global(global_lock);
+        int max_level_copy = max_level;
+        id_t ep_id = enterpoint;
+        if (cur_level <= max_level_copy) {
+            lock_global.unlock();
         }
 
-        if (enterpoint == -1) {
-            enterpoint = 0;
+        if (max_level_copy == -1) {
+            enterpoint = cur_id;
             max_level = cur_level;
             return;
         }
 
-        id_t ep_id = enterpoint;
-
-        if (cur_level < max_level) {
-            ep_id = search_down_to_level<false>(enterpoint, data, len, cur_level);
+        if (cur_level < max_level_copy) {
+            ep_id = search_down_to_level<false>(ep_id, data, len, max_level_copy, cur_level);
         }
 
-        for (int level = std::min(cur_level, max_level); level >= 0; level--) {
-            auto top_candidates = search_level<false>(ep_id, data, len, level);
-            ep_id = mutually_connect_new_element(cur_id, top_candidates, level);
+        for (int level = std::min(cur_level, max_level_copy); level >= 0; level--) {
+            auto top_candidates = search_level<false>(ep_id, data, len, level, ef_construction);
+            if (!top_candidates.empty()) {
+                ep_id = mutually_connect_new_element(cur_id, top_candidates, level);
+            }
         }
 
-        if (cur_level > max_level) {
+        if (cur_level > max_level_copy) {
             enterpoint = cur_id;
             max_level = cur_level;
         }
     }
 
-    std::priority_queue<std::pair<float, id_t>> search_knn(const float* query, int len, size_t k) {
-        id_t ep_id = search_down_to_level<true>(enterpoint, query, len, 0);
-        auto top_candidates = search_level<true>(ep_id, query, len, 0);
+    // 同一批内的元素互相不可见，批大小为已有元素数的 1/BATCH_RATIO，至多 MAX_BATCH 个
+    static constexpr size_t BATCH_RATIO = 16;
+    static constexpr size_t MAX_BATCH = 1024;
+
+    // 按 id 顺序批同步地插入 count 个元素，data[i] / lens[i] 对应 id first + i。每批元素先并行地在冻结的图上
+    // 搜索并选出各自的邻居，再按邻居分组并行地追加反向边，同一邻居收到的新元素按 id 顺序处理。
+    // 构建出的图只取决于数据和 id，与线程数和调度无关；不能与其他插入或查询并发调用
+    void add_points(const float* const* data, const int* lens, id_t first, int count, int num_threads = 1) {
+        int done = 0;
+        if (count > 0 && max_level == -1) {
+            add_point(data[0], lens[0], first);
+            done = 1;
+        }
+        while (done < count) {
+            int batch = std::min<size_t>(count - done, std::clamp<size_t>(cur_elements / BATCH_RATIO, 1, MAX_BATCH));
+            add_batch(data + done, lens + done, first + done, batch, num_threads);
+            done += batch;
+        }
+    }
+
+    void add_batch(const float* const* data, const int* lens, id_t first, int count, int num_threads) {
+        for (int i = 0; i < count; i++) {
+            allocate_element(first + i, lens[i]);
+        }
+
+        // 新元素在反向边写入之前不可达，搜索只会读到冻结的图，各元素只写自己的邻接表
+        int max_level_copy = max_level;
+        id_t ep_copy = enterpoint;
+        std::vector<std::vector<std::vector<id_t>>> selected(count);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+        for (int i = 0; i < count; i++) {
+            id_t cur_id = first + i;
+            int cur_level = element_levels[cur_id];
+            fill_element(cur_id, data[i], lens[i]);
+
+            id_t ep_id = ep_copy;
+            if (cur_level < max_level_copy) {
+                ep_id = search_down_to_level<false>(ep_id, data[i], lens[i], max_level_copy, cur_level);
+            }
+            selected[i].resize(std::min(cur_level, max_level_copy) + 1);
+            for (int level = std::min(cur_level, max_level_copy); level >= 0; level--) {
+                auto top_candidates = search_level<false>(ep_id, data[i], lens[i], level, ef_construction);
+                if (!top_candidates.empty()) {
+                    ep_id = select_neighbors(cur_id, top_candidates, level, selected[i][level]);
+                }
+            }
+        }
+
+        // 反向边按 (邻居, 新元素) 排序后分组，每组只改写一个邻居的邻接表
+        std::vector<std::pair<id_t, id_t>> edges;
+        std::vector<size_t> groups;
+        for (int level = 0; level <= max_level_copy; level++) {
+            edges.clear();
+            for (int i = 0; i < count; i++) {
+                if (level < (int)selected[i].size()) {
+                    for (id_t nei_id : selected[i][level]) {
+                        edges.emplace_back(nei_id, first + i);
+                    }
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+            std::vector<id_t> new_ids(edges.size());
+            groups.clear();
+            for (size_t j = 0; j < edges.size(); j++) {
+                new_ids[j] = edges[j].second;
+                if (j == 0 || edges[j].first != edges[j - 1].first) {
+                    groups.push_back(j);
+                }
+            }
+            groups.push_back(edges.size());
+
+            int num_groups = groups.size() - 1;
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 16)
+            for (int g = 0; g < num_groups; g++) {
+                connect_back(edges[groups[g]].first, new_ids.data() + groups[g], groups[g + 1] - groups[g], level);
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (element_levels[first + i] > max_level) {
+                max_level = element_levels[first + i];
+                enterpoint = first + i;
+            }
+        }
+    }
+
+    // 在已有元素之后追加一个序列，容量不足时翻倍扩容；不能与其他插入或查询并发调用
+    id_t insert_point(const float* data, int len) {
+        if (cur_elements == max_elements) {
+            resize(std::max<size_t>(max_elements * 2, 16));
+        }
+        id_t id = cur_elements;
+        add_point(data, len, id);
+        return id;
+    }
+
+    // 打删除标记，查询不再返回该元素，但它仍参与路由，直到 repair_deleted 把它从图中摘除
+    bool mark_deleted(id_t id) {
+        if (id >= cur_elements || element_deleted[id]) {
+            return false;
+        }
+        element_deleted[id] = 1;
+        num_deleted++;
+        return true;
+    }
+
+    // 修复删除留下的空洞：邻接表中含已删除元素的存活元素，以原有的存活邻居和已删除邻居的存活邻居为候选重新选边；
+    // 之后已删除元素不再可达，长度和层数清零；入口点被删除时改用层数最高的存活元素。已摘除元素占用的内存池空间
+    // 累计超过 1/COMPACT_RATIO 时调用 compact 回收。
+    // 各元素只改写自己的邻接表，可多线程执行，但不能与插入或查询并发；返回重新选边的邻接表数
+    size_t repair_deleted(int num_threads = 1) {
+        size_t repaired = 0;
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 64) reduction(+ : repaired)
+        for (id_t id = 0; id < cur_elements; id++) {
+            if (element_deleted[id]) {
+                continue;
+            }
+            for (int level = 0; level <= element_levels[id]; level++) {
+                linklist_t* ll = addr_linklist(id, level);
+                int size = get_ll_size(ll);
+                id_t* neighbors = get_ll_neighbors(ll);
+                if (std::none_of(neighbors, neighbors + size, [&](id_t n) { return element_deleted[n] != 0; })) {
+                    continue;
+                }
+
+                // 保留原有的存活邻居（其中包括插入时建立的远程反向边），空出的位置按距离用已删除邻居的存活邻居补上
+                int kept = 0;
+                std::vector<id_t> candidate_ids;
+                for (int i = 0; i < size; i++) {
+                    if (!element_deleted[neighbors[i]]) {
+                        neighbors[kept++] = neighbors[i];
+                        continue;
+                    }
+                    linklist_t* del_ll = addr_linklist(neighbors[i], level);
+                    id_t* del_neighbors = get_ll_neighbors(del_ll);
+                    for (int j = 0; j < get_ll_size(del_ll); j++) {
+                        if (!element_deleted[del_neighbors[j]] && del_neighbors[j] != id) {
+                            candidate_ids.push_back(del_neighbors[j]);
+                        }
+                    }
+                }
+                std::sort(candidate_ids.begin(), candidate_ids.end());
+                candidate_ids.erase(std::unique(candidate_ids.begin(), candidate_ids.end()), candidate_ids.end());
+
+                std::vector<std::pair<float, id_t>> sorted;
+                for (id_t c : candidate_ids) {
+                    if (std::find(neighbors, neighbors + kept, c) == neighbors + kept) {
+                        sorted.emplace_back(distance_between(id, c), c);
+                    }
+                }
+                std::sort(sorted.begin(), sorted.end());
+
+                // 邻接表不超过原来的长度，已满的邻接表在之后的插入中会触发启发式裁剪，把补进来的边裁掉
+                int old_size = size;
+                size = kept;
+                for (int i = 0; i < sorted.size() && size < old_size; i++) {
+                    neighbors[size++] = sorted[i].second;
+                }
+                set_ll_size(ll, size);
+                repaired++;
+            }
+        }
+
+        for (id_t id = 0; id < cur_elements; id++) {
+            if (element_deleted[id] != 1) {
+                continue;
+            }
+            memset(addr_link_level0(id), 0, size_links_level0);
+            dead_bytes += align_up(vector_size * element_lens[id], CACHE_LINE_SIZE) +
+                          (element_levels[id] > 0 ? align_up(size_links_level * element_levels[id], CACHE_LINE_SIZE) : 0);
+            element_lens[id] = 0;
+            element_levels[id] = 0;
+            element_deleted[id] = 2;
+        }
+        if (dead_bytes * COMPACT_RATIO > data_arena.used_bytes + link_arena.used_bytes) {
+            compact();
+        }
+
+        if (max_level >= 0 && element_deleted[enterpoint]) {
+            max_level = -1;
+            for (id_t id = 0; id < cur_elements; id++) {
+                if (!element_deleted[id] && element_levels[id] > max_level) {
+                    max_level = element_levels[id];
+                    enterpoint = id;
+                }
+            }
+        }
+        return repaired;
+    }
+
+    // 按 id 顺序把存活元素的序列数据和上层邻接表拷贝到新的内存池并更新偏移，旧池的内存随之释放；
+    // 从文件加载的索引还会拷贝第 0 层邻接表并关闭映射。id 不变，第 0 层邻接表仍按 max_elements 分配。
+    // 压缩期间新旧两份数据同时存在；不能与插入或查询并发调用
+    void compact() {
+        ChunkedArena new_data(data_arena.chunk_bits, data_arena.use_hugepages);
+        ChunkedArena new_links(link_arena.chunk_bits, link_arena.use_hugepages);
+        for (id_t id = 0; id < cur_elements; id++) {
+            if (element_deleted[id] == 2) {
+                data_offsets[id] = 0;
+                link_offsets[id] = 0;
+                continue;
+            }
+            size_t data_bytes = vector_size * element_lens[id];
+            size_t offset = new_data.allocate(data_bytes);
+            memcpy(new_data.addr(offset), addr_data(id), data_bytes);
+            data_offsets[id] = offset;
+            if (element_levels[id] > 0) {
+                size_t link_bytes = size_links_level * element_levels[id];
+                offset = new_links.allocate(link_bytes);
+                memcpy(new_links.addr(offset), addr_link_level(id, 1), link_bytes);
+                link_offsets[id] = offset;
+            }
+        }
+        data_arena.swap(new_data);
+        link_arena.swap(new_links);
+
+        if (!links0_owned) {
+            char* new_links0 = aligned_malloc(max_elements * size_links_level0, data_arena.use_hugepages);
+            memcpy(new_links0, links0, cur_elements * size_links_level0);
+            links0 = new_links0;
+            links0_owned = true;
+        }
+        mapped_file.close();
+        dead_bytes = 0;
+    }
+
+    std::priority_queue<std::pair<float, id_t>> search_knn(const float* query, int len, size_t k, size_t ef) {
+        if (max_level == -1) {
+            return {};
+        }
+        id_t ep_id = search_down_to_level<true>(enterpoint, query, len, max_level, 0);
+        auto top_candidates = search_level<true>(ep_id, query, len, 0, ef);
         while (top_candidates.size() > k) {
             top_candidates.pop();
         }
@@ -10,22 +10,150 @@ public:
     int M;
     int ef_construction;
     MultiHNSW* hnsw;
+    ScalarQuantizer* quantizer;
+    // 邻接表和序列数据的内存按 2MB 对齐并使用透明大页
+    bool use_hugepages;
+    // 大于 0 时每个序列保存至多 proxy_segments 个分段均值向量，查询时先用其上的代理距离筛选邻居，
+    // 只对前 proxy_ratio 比例的邻居计算精确距离
+    int proxy_segments;
+    float proxy_ratio;
+    // 构建期序列对距离缓存的容量（MB），0 为不使用
+    int pair_cache_mb;
+    std::vector<std::pair<std::string, long>> build_metrics;
 
     MultiHNSWIndex(int dim, VSSSpace* space, int M, int ef_construction)
-        : VSSIndex(dim, space), M(M), ef_construction(ef_construction) {}
+        : VSSIndex(dim, space), M(M), ef_construction(ef_construction), hnsw(nullptr), quantizer(nullptr),
+          use_hugepages(false), proxy_segments(0), proxy_ratio(1.0f), pair_cache_mb(0) {}
 
-    ~MultiHNSWIndex() { delete hnsw; }
+    ~MultiHNSWIndex() {
+        delete hnsw;
+        delete quantizer;
+    }
+
+    void build(const VSSDataset* base_dataset) { build_prefix(base_dataset, base_dataset->seq_num); }
+
+    // 只用前 num 个序列构建，其余序列可之后通过 insert 追加
+    void build_prefix(const VSSDataset* base_dataset, int num) {
+        if (sq_type != SQ_NONE) {
+            size_t size = 0;
+            for (int i = 0; i < num; i++) {
+                size += base_dataset->seq_len[i];
+            }
+            quantizer = new ScalarQuantizer(dim, sq_type);
+            quantizer->train(base_dataset->data, size);
+        }
+
+        hnsw = new MultiHNSW(space, num, M, ef_construction, 100, quantizer, use_hugepages);
+        init_proxies();
+        if (num == 0) {
+            return;
+        }
+
+        // 批同步插入，构建出的图与 build_threads 无关
+        begin_pair_cache();
+        hnsw->add_points(base_dataset->seq_data.data(), base_dataset->seq_len.data(), 0, num, build_threads);
+        end_pair_cache();
+    }
+
+    // 邻居裁剪时同一对序列的距离会被反复计算，构建期间缓存下来，构建结束后释放并记录命中率
+    void begin_pair_cache() {
+        build_metrics.clear();
+        if (pair_cache_mb > 0) {
+            hnsw->pair_cache = new PairDistanceCache(((size_t)pair_cache_mb << 20) / sizeof(PairDistanceCache::Entry));
+        }
+    }
+
+    void end_pair_cache() {
+        PairDistanceCache* cache = hnsw->pair_cache;
+        if (cache == nullptr) {
+            return;
+        }
+        build_metrics = {
+            {"pair_cache_lookups", cache->lookups},
+            {"pair_cache_hits", cache->hits},
+            {"pair_cache_hit_pct", cache->lookups == 0 ? 0 : cache->hits * 100 / cache->lookups},
+            {"pair_cache_bytes", (long)cache->memory_usage()},
+        };
+        hnsw->pair_cache = nullptr;
+        delete cache;
+    }
+
+    std::vector<std::pair<std::string, long>> get_build_metrics() override { return build_metrics; }
+
+    // 摘要不写入索引文件，构建前或加载后按当前参数计算
+    void init_proxies() {
+        if (proxy_segments > 0) {
+            hnsw->build_proxies(proxy_segments, build_threads);
+            hnsw->proxy_ratio = proxy_ratio;
+        }
+    }
+
+    // 在线更新：insert 追加序列并返回其 id，remove 打删除标记，repair 把已删除序列从图中摘除，
+    // 摘除的序列累计占内存池的 1/4 以上时压缩内存池回收存储；
+    // 三者都不能与查询并发调用
+    int insert(const float* data, int len) { return hnsw->insert_point(data, len); }
+
+    bool remove(int id) { return hnsw->mark_deleted(id); }
+
+    size_t repair() { return hnsw->repair_deleted(build_threads); }
 
-    void build(const VSSDataset* base_dataset) {
-        hnsw = new MultiHNSW(space, base_dataset->seq_num, M, ef_construction);
-        for (int i = 0; i < base_dataset->seq_num; i++) {
-            hnsw->add_point(base_dataset->seq_data[i], base_dataset->seq_len[i], i);
+    // 序列数据内嵌在图中，可以逐块插入后丢弃原始数据；量化时用第一块训练量化器
+    bool build_streaming(VSSChunkReader& reader) override {
+        while (reader.next()) {
+            if (hnsw == nullptr) {
+                if (sq_type != SQ_NONE) {
+                    quantizer = new ScalarQuantizer(dim, sq_type);
+                    quantizer->train(reader.chunk_data.data(), reader.chunk_size);
+                }
+                hnsw = new MultiHNSW(space, reader.seq_num, M, ef_construction, 100, quantizer, use_hugepages);
+                init_proxies();
+                begin_pair_cache();
+            }
+            hnsw->add_points(reader.chunk_seq_data.data(), reader.seq_len.data() + reader.chunk_begin,
+                             reader.chunk_begin, reader.chunk_num, build_threads);
         }
+        if (hnsw == nullptr) {
+            return false;
+        }
+        end_pair_cache();
+        return true;
+    }
+
+    // 摘要只在查询时筛选邻居且加载后重新计算，序列对距离缓存不改变构建出的图，都不记入文件名
+    std::string get_build_params() const override {
+        return "-M" + std::to_string(M) + "-efc" + std::to_string(ef_construction);
+    }
+
+    // 量化参数单独存放在 <path>.sq
+    bool save(const std::string& path) override {
+        hnsw->save(path);
+        if (quantizer) {
+            std::ofstream out(path + ".sq", std::ios::binary);
+            quantizer->save(out);
+        }
+        return true;
+    }
+
+    bool load(const std::string& path, const VSSDataset* base_dataset) override {
+        if (sq_type != SQ_NONE) {
+            quantizer = new ScalarQuantizer(dim, sq_type);
+            std::ifstream in(path + ".sq", std::ios::binary);
+            if (!quantizer->load(in)) {
+                return false;
+            }
+        }
+
+        hnsw = new MultiHNSW(space, 0, M, ef_construction, 100, quantizer);
+        if (!hnsw->load(path) || hnsw->M != M || hnsw->ef_construction != std::max(ef_construction, M) ||
+            hnsw->cur_elements != base_dataset->seq_num) {
+            return false;
+        }
+        init_proxies();
+        return true;
     }
 
     std::priority_queue<std::pair<float, int>> search(const float* q_data, int q_len, int k, int ef) override {
-        hnsw->ef = ef;
-        auto result = hnsw->search_knn(q_data, q_len, k);
+        auto result = hnsw->search_knn(q_data, q_len, k, ef);
         std::priority_queue<std::pair<float, int>> final_result;
         while (!result.empty()) {
             final_result.emplace(result.top());
@@ -34,15 +162,19 @@ public:
         return final_result;
     }
 
+    size_t get_memory_usage() override { return hnsw->memory_usage(); }
+
     std::vector<std::pair<std::string, long>> get_metrics() override {
         return {
             {"hops", hnsw->metric_hops},
             {"dist_comps", hnsw->metric_distance_computations},
+            {"proxy_comps", hnsw->metric_proxy_computations},
         };
     }
 
     void reset_metrics() override {
         hnsw->metric_distance_computations = 0;
+        hnsw->metric_proxy_computations = 0;
         hnsw->metric_hops = 0;
     }
 };
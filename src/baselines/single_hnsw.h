@@ -1,7 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+
 #include <hnswlib/hnswlib.h>
 
+#include "mmap_file.h"
+#include "visited_list.h"
+
 namespace vss {
 
 typedef size_t label_t;
@@ -11,39 +17,13 @@ typedef unsigned int linklist_t;
 template<typename dist_t>
 class SingleHNSW {
 public:
-    class VisitedList {
-    public:
-        typedef unsigned short tag_t;
-
-        size_t num_elements;
-        tag_t tag;
-        tag_t* mass;
-
-        VisitedList(size_t num_elements) : num_elements(num_elements), tag(-1), mass(new tag_t[num_elements]) {}
-
-        inline void reset() {
-            tag++;
-            if (tag == 0) {
-                tag = 1;
-                memset(mass, 0, sizeof(tag_t) * num_elements);
-            }
-        }
-
-        inline void visit(id_t id) { mass[id] = tag; }
-
-        inline bool is_visited(id_t id) const { return mass[id] == tag; }
-
-        ~VisitedList() { delete[] mass; }
-    };
-
     size_t max_elements;
-    size_t cur_elements;
+    std::atomic<size_t> cur_elements;
 
     size_t M;
     size_t max_M;
     size_t max_M0;
     size_t ef_construction;
-    size_t ef;
 
     size_t data_size;
     hnswlib::DISTFUNC<dist_t> fstdistfunc;
@@ -51,7 +31,11 @@ public:
 
     int max_level;
     id_t enterpoint;
-    VisitedList* visited_list;
+    VisitedListPool* visited_list_pool;
+
+    // 并发构建：每个元素的邻接表各有一把锁，全局锁只在可能更新入口点和最高层时持有
+    std::vector<std::mutex> link_list_locks;
+    std::mutex global_lock;
 
     size_t size_links_level;
     size_t size_links_level0;
@@ -68,8 +52,12 @@ public:
     std::default_random_engine level_generator;
     std::default_random_engine update_probability_generator;
 
-    long metric_distance_computations;
-    long metric_hops;
+    // load 之后 elements 与各层邻接表都指向文件映射
+    MappedFile mapped_file;
+
+    // 并发查询时每个查询先在局部计数，结束时一次性累加
+    std::atomic<long> metric_distance_computations;
+    std::atomic<long> metric_hops;
 
     SingleHNSW(hnswlib::SpaceInterface<dist_t>* space, size_t max_elements, size_t M = 16, size_t ef_construction = 200,
                size_t random_seed = 100) {
@@ -80,7 +68,6 @@ public:
         this->max_M = M;
         this->max_M0 = M * 2;
         this->ef_construction = std::max(ef_construction, M);
-        this->ef = 10;
 
         this->data_size = space->get_data_size();
         this->fstdistfunc = space->get_dist_func();
@@ -88,7 +75,8 @@ public:
 
         this->max_level = -1;
         this->enterpoint = -1;
-        this->visited_list = new VisitedList(max_elements);
+        this->visited_list_pool = new VisitedListPool(max_elements);
+        this->link_list_locks = std::vector<std::mutex>(max_elements);
 
         this->size_links_level = sizeof(linklist_t) + max_M * sizeof(id_t);
         this->size_links_level0 = sizeof(linklist_t) + max_M0 * sizeof(id_t);
@@ -105,19 +93,121 @@ public:
         this->level_generator.seed(random_seed);
         this->update_probability_generator.seed(random_seed + 1);
 
+        // 层数按元素 id 预先生成；add_point 以调用者的 label 作为内部 id，层数只取决于 label，不受线程调度影响
+        for (size_t i = 0; i < max_elements; i++) {
+            this->element_levels[i] = get_random_level();
+        }
+
         this->metric_distance_computations = 0;
         this->metric_hops = 0;
     }
 
     ~SingleHNSW() {
-        free(visited_list);
-        free(elements);
+        delete visited_list_pool;
+        if (!mapped_file.is_open()) {
+            free(elements);
+            for (id_t i = 0; i < cur_elements; i++) {
+                if (element_levels[i] > 0) {
+                    free(linklists[i]);
+                }
+            }
+        }
+        free(linklists);
+    }
+
+    static constexpr uint64_t FILE_MAGIC = 0x57534e4848535356; // "VSSHHNSW"
+
+    // 文件布局：参数头 | 元素块 (邻接表0 + 向量 + label) | 各元素层数 | 各元素上层邻接表
+    void save(const std::string& location) const {
+        std::ofstream out(location, std::ios::binary);
+        write_pod(out, FILE_MAGIC);
+        write_pod(out, INDEX_FILE_VERSION);
+        for (uint64_t v : {(uint64_t)data_size, (uint64_t)cur_elements, (uint64_t)M, (uint64_t)max_M, (uint64_t)max_M0,
+                           (uint64_t)ef_construction, (uint64_t)(int64_t)max_level, (uint64_t)enterpoint,
+                           (uint64_t)size_links_level, (uint64_t)size_links_level0, (uint64_t)size_element}) {
+            write_pod(out, v);
+        }
+        out.write(elements, cur_elements * size_element);
+        out.write((const char*)element_levels.data(), cur_elements * sizeof(int));
         for (id_t i = 0; i < cur_elements; i++) {
             if (element_levels[i] > 0) {
-                free(linklists[i]);
+                out.write(linklists[i], size_links_level * element_levels[i]);
+            }
+        }
+    }
+
+    // 加载 save 写出的文件，元素块和邻接表直接指向映射而不拷贝；加载后索引只读，容量即已有元素数
+    bool load(const std::string& location) {
+        if (!mapped_file.open(location)) {
+            return false;
+        }
+        const char* cur = mapped_file.data;
+        const char* end = mapped_file.data + mapped_file.size;
+
+        uint64_t header[13];
+        for (uint64_t& v : header) {
+            if (!read_pod(cur, end, v)) {
+                mapped_file.close();
+                return false;
             }
         }
+        size_t n = header[3];
+        if (header[0] != FILE_MAGIC || header[1] != INDEX_FILE_VERSION || header[2] != data_size ||
+            header[12] != size_links_level0 + data_size + sizeof(label_t) ||
+            cur + n * (header[12] + sizeof(int)) > end) {
+            mapped_file.close();
+            return false;
+        }
+        const int* levels = (const int*)(cur + n * header[12]);
+        size_t upper_bytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            upper_bytes += header[10] * levels[i];
+        }
+        if (cur + n * (header[12] + sizeof(int)) + upper_bytes != end) {
+            mapped_file.close();
+            return false;
+        }
+
+        free(elements);
         free(linklists);
+        delete visited_list_pool;
+
+        this->max_elements = n;
+        this->cur_elements = n;
+        this->M = header[4];
+        this->max_M = header[5];
+        this->max_M0 = header[6];
+        this->ef_construction = header[7];
+        this->max_level = (int)(int64_t)header[8];
+        this->enterpoint = header[9];
+        this->size_links_level = header[10];
+        this->size_links_level0 = header[11];
+        this->size_element = header[12];
+        this->offset_data = size_links_level0;
+        this->offset_label = size_links_level0 + data_size;
+
+        this->elements = (char*)cur;
+        cur += n * size_element;
+        this->element_levels.assign((const int*)cur, (const int*)cur + n);
+        cur += n * sizeof(int);
+
+        this->linklists = (char**)malloc(n * sizeof(void*));
+        for (id_t i = 0; i < n; i++) {
+            linklists[i] = (char*)cur;
+            cur += size_links_level * element_levels[i];
+        }
+
+        this->visited_list_pool = new VisitedListPool(n);
+        this->link_list_locks = std::vector<std::mutex>(n);
+        return true;
+    }
+
+    size_t memory_usage() const {
+        size_t bytes = max_elements * (size_element + sizeof(void*) + sizeof(int) + sizeof(unsigned short));
+        for (id_t i = 0; i < cur_elements; i++) {
+            bytes += size_links_level * element_levels[i];
+        }
+        return bytes;
     }
 
     inline int get_random_level() {
@@ -148,22 +238,41 @@ public:
 
     inline void set_ll_size(linklist_t* ll, int size) { *((int*)ll) = size; }
 
+    // 构建时邻接表可能被其他线程修改，在锁内拷贝一份再计算距离
+    inline int copy_neighbors(id_t id, int level, id_t* buffer) {
+        std::unique_lock<std::mutex> lock(link_list_locks[id]);
+        linklist_t* ll = addr_linklist(id, level);
+        int size = get_ll_size(ll);
+        memcpy(buffer, get_ll_neighbors(ll), size * sizeof(id_t));
+        return size;
+    }
+
     template<bool collect_metrics>
-    id_t search_down_to_level(id_t ep_id, const void* query, int level) {
+    id_t search_down_to_level(id_t ep_id, const void* query, int top_level, int level) {
+        long hops = 0;
+        long distance_computations = 0;
+        std::vector<id_t> buffer(collect_metrics ? 0 : max_M0);
         id_t cur_id = ep_id;
         dist_t cur_dist = fstdistfunc(query, addr_data(cur_id), dist_func_param);
-        for (int lev = max_level; lev > level; lev--) {
+        for (int lev = top_level; lev > level; lev--) {
             bool changed = true;
             while (changed) {
                 changed = false;
 
-                linklist_t* ll = addr_linklist(cur_id, lev);
-                int size = get_ll_size(ll);
-                id_t* neighbors = get_ll_neighbors(ll);
+                int size;
+                id_t* neighbors;
+                if (collect_metrics) {
+                    linklist_t* ll = addr_linklist(cur_id, lev);
+                    size = get_ll_size(ll);
+                    neighbors = get_ll_neighbors(ll);
+                } else {
+                    size = copy_neighbors(cur_id, lev, buffer.data());
+                    neighbors = buffer.data();
+                }
 
                 if (collect_metrics) {
-                    metric_hops++;
-                    metric_distance_computations += size;
+                    hops++;
+                    distance_computations += size;
                 }
 
                 for (int i = 0; i < size; i++) {
@@ -177,20 +286,48 @@ public:
                 }
             }
         }
+
+        if (collect_metrics) {
+            metric_hops.fetch_add(hops, std::memory_order_relaxed);
+            metric_distance_computations.fetch_add(distance_computations, std::memory_order_relaxed);
+        }
         return cur_id;
     }
 
     template<bool collect_metrics>
-    std::priority_queue<std::pair<dist_t, id_t>> search_level(id_t ep_id, const void* query, int level) {
+    std::priority_queue<std::pair<dist_t, id_t>> search_level(id_t ep_id, const void* query, int level, size_t ef_) {
+        return search_level<collect_metrics>(&ep_id, 1, query, level, ef_);
+    }
+
+    // 从多个入口点同时开始的 beam search，每次计算入口点距离都计入 dist_comps（第一个除外，与单入口点时一致），
+    // 包括超出 ef_ 后被弹出的入口点
+    template<bool collect_metrics>
+    std::priority_queue<std::pair<dist_t, id_t>> search_level(const id_t* ep_ids, int num_eps, const void* query,
+                                                              int level, size_t ef_) {
+        long hops = 0;
+        long distance_computations = 0;
+        std::vector<id_t> buffer(collect_metrics ? 0 : max_M0 + 1);
+        VisitedList* visited_list = visited_list_pool->get();
         visited_list->reset();
         std::priority_queue<std::pair<dist_t, id_t>> top_candidates;
         std::priority_queue<std::pair<dist_t, id_t>> candidate_set;
-        dist_t lower_bound = fstdistfunc(query, addr_data(ep_id), dist_func_param);
-        top_candidates.emplace(lower_bound, ep_id);
-        candidate_set.emplace(-lower_bound, ep_id);
-        visited_list->visit(ep_id);
+        for (int i = 0; i < num_eps; i++) {
+            if (visited_list->is_visited(ep_ids[i])) {
+                continue;
+            }
+            visited_list->visit(ep_ids[i]);
+            if (collect_metrics && !top_candidates.empty()) {
+                distance_computations++;
+            }
+            dist_t dist = fstdistfunc(query, addr_data(ep_ids[i]), dist_func_param);
+            top_candidates.emplace(dist, ep_ids[i]);
+            candidate_set.emplace(-dist, ep_ids[i]);
+            if (top_candidates.size() > ef_) {
+                top_candidates.pop();
+            }
+        }
+        dist_t lower_bound = top_candidates.top().first;
 
-        size_t ef_ = collect_metrics ? ef : ef_construction;
         while (!candidate_set.empty()) {
             auto [cur_dist, cur_id] = candidate_set.top();
             if (-cur_dist > lower_bound && top_candidates.size() >= ef_) {
@@ -198,12 +335,16 @@ public:
             }
             candidate_set.pop();
 
-            linklist_t* ll = addr_linklist(cur_id, level);
-            int size = get_ll_size(ll);
-            id_t* neighbors = get_ll_neighbors(ll);
-
+            int size;
+            id_t* neighbors;
             if (collect_metrics) {
-                metric_hops++;
+                linklist_t* ll = addr_linklist(cur_id, level);
+                size = get_ll_size(ll);
+                neighbors = get_ll_neighbors(ll);
+                hops++;
+            } else {
+                size = copy_neighbors(cur_id, level, buffer.data());
+                neighbors = buffer.data();
             }
 
 #ifdef USE_SSE
@@ -226,7 +367,7 @@ public:
                 visited_list->visit(nei_id);
 
                 if (collect_metrics) {
-                    metric_distance_computations++;
+                    distance_computations++;
                 }
 
                 dist_t dist = fstdistfunc(query, addr_data(nei_id), dist_func_param);
@@ -244,6 +385,11 @@ public:
             }
         }
 
+        visited_list_pool->release(visited_list);
+        if (collect_metrics) {
+            metric_hops.fetch_add(hops, std::memory_order_relaxed);
+            metric_distance_computations.fetch_add(distance_computations, std::memory_order_relaxed);
+        }
         return top_candidates;
     }
 
@@ -308,6 +454,7 @@ public:
 
         size_t level_M = level == 0 ? max_M0 : max_M;
         for (int i = 0; i < selected_neighbors.size(); i++) {
+            std::unique_lock<std::mutex> lock(link_list_locks[selected_neighbors[i]]);
             linklist_t* other_ll = addr_linklist(selected_neighbors[i], level);
             int other_size = get_ll_size(other_ll);
             id_t* other_neighbors = get_ll_neighbors(other_ll);
@@ -339,10 +486,17 @@ public:
         return next_id;
     }
 
+    // 可并发调用，插入期间持有新元素自身的锁，其他线程在其连入图之前不会访问它
+    // label 须为 [0, max_elements) 内互不相同的值，直接作为内部 id
     void add_point(const void* query, label_t label) {
-        id_t cur_id = cur_elements++;
-        int cur_level = get_random_level();
-        element_levels[cur_id] = cur_level;
+        if (label >= max_elements) {
+            std::cerr << "SingleHNSW label out of range: " << label << std::endl;
+            exit(-1);
+        }
+        id_t cur_id = label;
+        cur_elements++;
+        int cur_level = element_levels[cur_id];
+        std::unique_lock<std::mutex> lock_el(link_list_locks[cur_id]);
 
         memset(addr_element(cur_id), 0, size_element);
         memcpy(addr_data(cur_id), query, data_size);
@@ -353,32 +507,186 @@ public:
             memset(linklists[cur_id], 0, size_links_level * cur_level);
         }
 
-        if (enterpoint == -1) {
-            enterpoint = 0;
+        std::unique_lock<std::mutex> lock_global(global_lock);
+        int max_level_copy = max_level;
+        id_t ep_id = enterpoint;
+        if (cur_level <= max_level_copy) {
+            lock_global.unlock();
+        }
+
+        if (max_level_copy == -1) {
+            enterpoint = cur_id;
             max_level = cur_level;
             return;
         }
 
-        id_t ep_id = enterpoint;
-
-        if (cur_level < max_level) {
-            ep_id = search_down_to_level<false>(enterpoint, query, cur_level);
+        if (cur_level < max_level_copy) {
+            ep_id = search_down_to_level<false>(ep_id, query, max_level_copy, cur_level);
         }
 
-        for (int level = std::min(cur_level, max_level); level >= 0; level--) {
-            auto top_candidates = search_level<false>(ep_id, query, level);
+        for (int level = std::min(cur_level, max_level_copy); level >= 0; level--) {
+            auto top_candidates = search_level<false>(ep_id, query, level, ef_construction);
             ep_id = mutually_connect_new_element(cur_id, top_candidates, level);
         }
 
-        if (cur_level > max_level) {
+        if (cur_level > max_level_copy) {
             enterpoint = cur_id;
             max_level = cur_level;
         }
     }
 
-    std::priority_queue<std::pair<dist_t, label_t>> search_knn(const void* query, size_t k) {
-        id_t ep_id = search_down_to_level<true>(enterpoint, query, 0);
-        auto top_candidates = search_level<true>(ep_id, query, 0);
+    // Gorder 式的贪心排序：从入口点开始，每次取与最近放置的 window 个元素（第 0 层）相连最多的未放置元素，
+    // 最后放置的元素的邻居计两次；没有候选时取 id 最小的未放置元素。BFS / RCM 在 HNSW 这样扩张很快的图上
+    // 会把同一元素的邻居分散到整层前沿里，反而不如原顺序
+    std::vector<id_t> locality_order(int window = 5) const {
+        size_t n = cur_elements;
+        std::vector<id_t> order;
+        std::vector<char> placed(n, 0);
+        std::vector<int> score(n, 0);
+        std::vector<id_t> candidates;
+        order.reserve(n);
+        size_t next_unplaced = 0;
+        id_t cur_id = enterpoint;
+        while (true) {
+            placed[cur_id] = 1;
+            order.push_back(cur_id);
+            if (order.size() == n) {
+                break;
+            }
+
+            candidates.clear();
+            for (size_t k = order.size() > (size_t)window ? order.size() - window : 0; k < order.size(); k++) {
+                linklist_t* ll = addr_link_level0(order[k]);
+                int size = get_ll_size(ll);
+                id_t* neighbors = get_ll_neighbors(ll);
+                for (int i = 0; i < size; i++) {
+                    if (placed[neighbors[i]]) {
+                        continue;
+                    }
+                    if (score[neighbors[i]] == 0) {
+                        candidates.push_back(neighbors[i]);
+                    }
+                    score[neighbors[i]] += k + 1 == order.size() ? 2 : 1;
+                }
+            }
+
+            int best_score = 0;
+            for (id_t id : candidates) {
+                if (score[id] > best_score) {
+                    best_score = score[id];
+                    cur_id = id;
+                }
+                score[id] = 0;
+            }
+            if (best_score == 0) {
+                while (placed[next_unplaced]) {
+                    next_unplaced++;
+                }
+                cur_id = next_unplaced;
+            }
+        }
+        return order;
+    }
+
+    // 按 order（新 id -> 旧 id）重新分配内部 id，使图上相邻的元素在内存中也相邻，减少查询逐跳访问时的缓存缺失。
+    // 元素块整体搬动，label 随之保留；只能在构建完成之后调用，load 得到的映射索引不能重排
+    void permute(const std::vector<id_t>& order, int num_threads = 1) {
+        size_t n = cur_elements;
+        std::vector<id_t> new_id(n);
+        for (size_t i = 0; i < n; i++) {
+            new_id[order[i]] = i;
+        }
+
+        char* new_elements = (char*)malloc(max_elements * size_element);
+        char** new_linklists = (char**)malloc(max_elements * sizeof(void*));
+        std::vector<int> new_levels(element_levels);
+#pragma omp parallel for num_threads(num_threads) schedule(static, 1024)
+        for (size_t i = 0; i < n; i++) {
+            id_t old_id = order[i];
+            memcpy(new_elements + i * size_element, addr_element(old_id), size_element);
+            new_levels[i] = element_levels[old_id];
+            new_linklists[i] = new_levels[i] > 0 ? linklists[old_id] : nullptr;
+
+            // 元素块已在新位置，上层邻接表只是换了所属 id，各层都只改写一次
+            for (int level = 0; level <= new_levels[i]; level++) {
+                linklist_t* ll = level == 0 ? (linklist_t*)(new_elements + i * size_element + offset_links)
+                                            : (linklist_t*)(new_linklists[i] + (level - 1) * size_links_level);
+                int size = get_ll_size(ll);
+                id_t* neighbors = get_ll_neighbors(ll);
+                for (int j = 0; j < size; j++) {
+                    neighbors[j] = new_id[neighbors[j]];
+                }
+            }
+        }
+
+        free(elements);
+        free(linklists);
+        this->elements = new_elements;
+        this->linklists = new_linklists;
+        this->element_levels.swap(new_levels);
+        this->enterpoint = new_id[enterpoint];
+    }
+
+    // 同一查询序列的多个 token 一起检索，queries 为连续存放的 num 个向量。每个 token 先找与它最相近的已检索 token，
+    // 若两者的距离不超过那个 token 第 k 个结果的距离，说明落在图中同一区域，直接以那个 token 的前 seeds 个结果
+    // 作为第 0 层的起点，省去上层下降并缩短第 0 层的搜索路径；否则照常从全局入口点下降。token 之间的距离计入 dist_comps
+    std::vector<std::priority_queue<std::pair<dist_t, label_t>>> search_knn_batch(const void* queries, int num,
+                                                                                 size_t k, size_t ef, int seeds = 1) {
+        std::vector<std::priority_queue<std::pair<dist_t, label_t>>> results(num);
+        auto query = [&](int i) { return (const void*)((const char*)queries + (size_t)i * data_size); };
+
+        // 每个已检索 token 的前 seeds 个结果（内部 id，按距离升序）及第 k 个结果的距离
+        std::vector<id_t> found((size_t)num * seeds);
+        std::vector<int> found_num(num, 0);
+        std::vector<dist_t> found_radius(num);
+        std::vector<id_t> ep_ids;
+        long distance_computations = 0;
+        for (int i = 0; i < num; i++) {
+            int nearest = -1;
+            dist_t nearest_dist = std::numeric_limits<dist_t>::max();
+            for (int j = 0; j < i; j++) {
+                dist_t d = fstdistfunc(query(i), query(j), dist_func_param);
+                if (d < nearest_dist) {
+                    nearest_dist = d;
+                    nearest = j;
+                }
+            }
+            distance_computations += i;
+
+            if (nearest >= 0 && found_num[nearest] > 0 && nearest_dist <= found_radius[nearest]) {
+                ep_ids.assign(found.begin() + (size_t)nearest * seeds,
+                              found.begin() + (size_t)nearest * seeds + found_num[nearest]);
+            } else {
+                ep_ids.assign(1, search_down_to_level<true>(enterpoint, query(i), max_level, 0));
+            }
+
+            auto top_candidates = search_level<true>(ep_ids.data(), ep_ids.size(), query(i), 0, ef);
+            while (top_candidates.size() > k) {
+                top_candidates.pop();
+            }
+
+            // 出堆顺序为距离降序，最后出堆的 seeds 个即最近的结果
+            int pos = top_candidates.size();
+            found_num[i] = std::min(pos, seeds);
+            found_radius[i] = top_candidates.empty() ? 0 : top_candidates.top().first;
+            while (!top_candidates.empty()) {
+                auto [dist, id] = top_candidates.top();
+                top_candidates.pop();
+                pos--;
+                if (pos < seeds) {
+                    found[(size_t)i * seeds + pos] = id;
+                }
+                results[i].emplace(dist, *addr_label(id));
+            }
+        }
+
+        metric_distance_computations.fetch_add(distance_computations, std::memory_order_relaxed);
+        return results;
+    }
+
+    std::priority_queue<std::pair<dist_t, label_t>> search_knn(const void* query, size_t k, size_t ef) {
+        id_t ep_id = search_down_to_level<true>(enterpoint, query, max_level, 0);
+        auto top_candidates = search_level<true>(ep_id, query, 0, ef);
         while (top_candidates.size() > k) {
             top_candidates.pop();
         }
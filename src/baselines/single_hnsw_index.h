@@ -10,38 +10,87 @@ public:
     int M;
     int ef_construction;
     SingleHNSW<float>* hnsw;
+    // 查询序列的各 token 是否一起检索（search_knn_batch），否则每个 token 独立从全局入口点检索
+    bool batch_tokens;
+    // 构建完成后按图上的局部性重排元素（SingleHNSW::locality_order），保存的索引文件也是重排后的布局
+    bool reorder;
+    std::vector<std::pair<std::string, long>> build_metrics;
 
     SingleHNSWIndex(int dim, VSSSpace* space, int M, int ef_construction)
-        : RerankIndex(dim, space), M(M), ef_construction(ef_construction) {}
+        : RerankIndex(dim, space), M(M), ef_construction(ef_construction), hnsw(nullptr), batch_tokens(false),
+          reorder(false) {}
 
     ~SingleHNSWIndex() { delete hnsw; }
 
     void build_vectors(const float* data, int size) override {
         hnsw = new SingleHNSW<float>(space->space, size, M, ef_construction);
 
-        const float* vec = data;
-        for (size_t i = 0; i < size; i++, vec += dim) {
-            hnsw->add_point(vec, i);
+        if (size == 0) {
+            return;
+        }
+
+        // 第一个点串行插入作为入口点，其余点按 id 顺序分发给各线程
+        hnsw->add_point(data, 0);
+#pragma omp parallel for num_threads(build_threads) schedule(dynamic, 64)
+        for (int i = 1; i < size; i++) {
+            hnsw->add_point(data + (size_t)i * dim, i);
+        }
+
+        build_metrics.clear();
+        if (reorder) {
+            auto begin = std::chrono::high_resolution_clock::now();
+            hnsw->permute(hnsw->locality_order(), build_threads);
+            auto end = std::chrono::high_resolution_clock::now();
+            build_metrics.push_back(
+                {"reorder_us", std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()});
         }
     }
 
-    std::unordered_set<int> search_candidates(const float* q_data, int q_len, int q_k) override {
-        hnsw->ef = q_k;
-        std::unordered_set<int> candidates;
+    std::vector<std::pair<std::string, long>> get_build_metrics() override { return build_metrics; }
+
+    std::string get_build_params() const override {
+        return "-M" + std::to_string(M) + "-efc" + std::to_string(ef_construction) + (reorder ? "-reorder" : "");
+    }
+
+    bool save_vectors(const std::string& path) override {
+        hnsw->save(path);
+        return true;
+    }
+
+    bool load_vectors(const std::string& path) override {
+        hnsw = new SingleHNSW<float>(space->space, 0, M, ef_construction);
+        return hnsw->load(path) && hnsw->M == M && hnsw->ef_construction == std::max(ef_construction, M) &&
+               hnsw->cur_elements == vec_to_seq.size();
+    }
+
+    void search_candidates(const float* q_data, int q_len, int q_k, CandidateList& candidates) override {
+        if (batch_tokens) {
+            for (auto& res : hnsw->search_knn_batch(q_data, q_len, q_k, q_k)) {
+                vote_token(res, candidates);
+            }
+            return;
+        }
 
         const float* q_vec = q_data;
         for (int i = 0; i < q_len; i++, q_vec += dim) {
-            auto res = hnsw->search_knn(q_vec, q_k);
-            while (!res.empty()) {
-                auto result = res.top();
-                res.pop();
-                candidates.insert(vec_to_seq[result.second]);
-            }
+            auto res = hnsw->search_knn(q_vec, q_k, q_k);
+            vote_token(res, candidates);
         }
+    }
 
-        return candidates;
+    inline void vote_token(std::priority_queue<std::pair<float, label_t>>& res, CandidateList& candidates) const {
+        candidates.begin_token();
+        float impute = res.empty() ? 0.0f : res.top().first;
+        while (!res.empty()) {
+            auto result = res.top();
+            res.pop();
+            candidates.vote(vec_to_seq[result.second], result.first);
+        }
+        candidates.end_token(impute);
     }
 
+    size_t get_memory_usage() override { return RerankIndex::get_memory_usage() + hnsw->memory_usage(); }
+
     std::vector<std::pair<std::string, long>> get_metrics() override {
         auto metrics = RerankIndex::get_metrics();
         metrics.push_back({"hops", hnsw->metric_hops});
@@ -1,13 +1,15 @@
 #pragma once
+#include <algorithm>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "mmap_file.h"
+
 namespace vss {
 
 namespace fs = std::filesystem;
@@ -26,7 +28,14 @@ public:
     int size;
     float* data;
 
-    Dataset(int dim, fs::path path) : dim(dim) {
+    // mmap 模式下 data 直接指向稠密文件的映射
+    MappedFile mapped_file;
+
+    Dataset(int dim, fs::path path, bool use_mmap = false) : dim(dim) {
+        if (use_mmap && load_mapped(path)) {
+            return;
+        }
+
         std::ifstream in(path, std::ios::binary);
         cerr_if(!in.is_open(), "Fail to open vector file: ", path);
 
@@ -48,7 +57,65 @@ public:
         in.close();
     }
 
-    ~Dataset() { delete[] data; }
+    // fvecs 每个向量前带 4 字节维度，无法直接映射；首次使用时转换为无头的稠密文件 <path>.dense，之后直接映射
+    bool load_mapped(const fs::path& path) {
+        fs::path dense_path = path;
+        dense_path += ".dense";
+        std::error_code ec;
+        bool fresh = fs::exists(dense_path, ec) && fs::last_write_time(dense_path, ec) >= fs::last_write_time(path, ec);
+        if (!fresh && !convert_dense(path, dense_path)) {
+            std::cerr << "Fail to convert " << path << " to dense format, fallback to reading" << std::endl;
+            return false;
+        }
+
+        if (!mapped_file.open(dense_path.string()) || mapped_file.size % (dim * sizeof(float)) != 0) {
+            mapped_file.close();
+            return false;
+        }
+        size = mapped_file.size / (dim * sizeof(float));
+        data = (float*)mapped_file.data;
+        return true;
+    }
+
+    // 分块顺序读入 fvecs 并去掉每行的维度头，先写临时文件再改名，避免留下不完整的稠密文件
+    bool convert_dense(const fs::path& path, const fs::path& dense_path) {
+        std::ifstream in(path, std::ios::binary);
+        cerr_if(!in.is_open(), "Fail to open vector file: ", path);
+
+        fs::path tmp_path = dense_path;
+        tmp_path += ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        const size_t row = dim + 1;
+        std::vector<float> buffer(row * 4096);
+        while (in) {
+            in.read((char*)buffer.data(), buffer.size() * sizeof(float));
+            size_t n = in.gcount() / (row * sizeof(float));
+            for (size_t i = 0; i < n; i++) {
+                int file_dim;
+                memcpy(&file_dim, buffer.data() + i * row, 4);
+                cerr_if(file_dim != dim, "Dimension mismatch: ", file_dim, ", ", dim);
+                out.write((const char*)(buffer.data() + i * row + 1), dim * sizeof(float));
+            }
+        }
+        out.close();
+        if (!out) {
+            return false;
+        }
+
+        std::error_code ec;
+        fs::rename(tmp_path, dense_path, ec);
+        return !ec;
+    }
+
+    ~Dataset() {
+        if (!mapped_file.is_open()) {
+            delete[] data;
+        }
+    }
 };
 
 class VSSDataset : public Dataset {
@@ -57,7 +124,8 @@ public:
     std::vector<const float*> seq_data;
     std::vector<int> seq_len;
 
-    VSSDataset(int dim, fs::path vector_path, fs::path length_path) : Dataset(dim, vector_path) {
+    VSSDataset(int dim, fs::path vector_path, fs::path length_path, bool use_mmap = false)
+        : Dataset(dim, vector_path, use_mmap) {
         std::ifstream in(length_path, std::ios::binary);
         cerr_if(!in.is_open(), "Fail to open length file: ", length_path);
 
@@ -81,7 +149,82 @@ public:
     std::pair<const float*, int> get_data_len(int seq_id) const { return {seq_data[seq_id], seq_len[seq_id]}; }
 };
 
-std::vector<std::unordered_set<int>> read_groundtruth(fs::path path) {
+// 按固定序列数分块顺序读取 base.fvecs / base.lens，流式构建时内存中只保留当前块
+class VSSChunkReader {
+public:
+    int dim;
+    int seq_num;
+    size_t size;
+    std::vector<int> seq_len;
+
+    int chunk_seqs;
+    int chunk_begin;
+    int chunk_num;
+    size_t chunk_size;
+    std::vector<float> chunk_data;
+    std::vector<const float*> chunk_seq_data;
+
+    std::ifstream in;
+
+    VSSChunkReader(int dim, fs::path vector_path, fs::path length_path, int chunk_seqs)
+        : dim(dim), chunk_seqs(chunk_seqs), chunk_begin(0), chunk_num(0), chunk_size(0) {
+        std::ifstream len_in(length_path, std::ios::binary);
+        cerr_if(!len_in.is_open(), "Fail to open length file: ", length_path);
+        len_in.seekg(0, std::ios::end);
+        seq_num = (size_t)len_in.tellg() / 4;
+        len_in.seekg(0, std::ios::beg);
+        seq_len.resize(seq_num);
+        len_in.read((char*)seq_len.data(), seq_num * 4);
+
+        size = 0;
+        for (int len : seq_len) {
+            size += len;
+        }
+
+        in.open(vector_path, std::ios::binary);
+        cerr_if(!in.is_open(), "Fail to open vector file: ", vector_path);
+    }
+
+    // 读入下一块，chunk_seq_data[i] 对应序列 chunk_begin + i；读完时返回 false
+    bool next() {
+        chunk_begin += chunk_num;
+        if (chunk_begin >= seq_num) {
+            chunk_num = 0;
+            chunk_size = 0;
+            return false;
+        }
+        chunk_num = std::min(chunk_seqs, seq_num - chunk_begin);
+
+        size_t vec_num = 0;
+        for (int i = 0; i < chunk_num; i++) {
+            vec_num += seq_len[chunk_begin + i];
+        }
+        chunk_size = vec_num;
+
+        // 连同每行的维度头一起读入，再原地前移去掉维度头
+        const size_t row = dim + 1;
+        chunk_data.resize(vec_num * row);
+        in.read((char*)chunk_data.data(), vec_num * row * sizeof(float));
+        cerr_if((size_t)in.gcount() != vec_num * row * sizeof(float), "Vector file shorter than length file");
+        for (size_t i = 0; i < vec_num; i++) {
+            int file_dim;
+            memcpy(&file_dim, chunk_data.data() + i * row, 4);
+            cerr_if(file_dim != dim, "Dimension mismatch: ", file_dim, ", ", dim);
+            memmove(chunk_data.data() + i * dim, chunk_data.data() + i * row + 1, dim * sizeof(float));
+        }
+
+        chunk_seq_data.resize(chunk_num);
+        const float* seq = chunk_data.data();
+        for (int i = 0; i < chunk_num; i++) {
+            chunk_seq_data[i] = seq;
+            seq += (size_t)seq_len[chunk_begin + i] * dim;
+        }
+        return true;
+    }
+};
+
+// 每个查询的真值按 id 升序存放，召回统计时二分查找
+std::vector<std::vector<int>> read_groundtruth(fs::path path) {
     std::ifstream in(path, std::ios::binary);
     cerr_if(!in.is_open(), "Fail to open groundtruth file: ", path);
 
@@ -93,13 +236,14 @@ std::vector<std::unordered_set<int>> read_groundtruth(fs::path path) {
     in.seekg(0, std::ios::beg);
 
     int size = fsize / ((k + 1) * 4);
-    std::vector<std::unordered_set<int>> gts;
+    std::vector<int> buffer((size_t)size * (k + 1));
+    in.read((char*)buffer.data(), buffer.size() * 4);
 
+    std::vector<std::vector<int>> gts(size);
     for (int i = 0; i < size; i++) {
-        std::vector<int> tmp(k);
-        in.seekg(4, std::ios::cur);
-        in.read((char*)tmp.data(), k * 4);
-        gts.emplace_back(tmp.begin(), tmp.end());
+        const int* row = buffer.data() + (size_t)i * (k + 1) + 1;
+        gts[i].assign(row, row + k);
+        std::sort(gts[i].begin(), gts[i].end());
     }
     return gts;
 }
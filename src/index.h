@@ -1,8 +1,13 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <queue>
+#include <string>
 
 #include "dataset.h"
 #include "space.h"
+#include "visited_list.h"
 
 namespace vss {
 
@@ -11,12 +16,163 @@ public:
     int dim;
     VSSSpace* space;
 
-    VSSIndex(int dim, VSSSpace* space) : dim(dim), space(space) {}
+    // 序列数据的存储方式，支持的索引在 build 时训练量化器
+    SQType sq_type;
+    // 单个查询内部使用的线程数
+    int num_threads;
+    // 构建图索引时并发插入的线程数
+    int build_threads;
+
+    VSSIndex(int dim, VSSSpace* space)
+        : dim(dim), space(space), sq_type(SQ_NONE), num_threads(1), build_threads(1) {}
+
+    virtual ~VSSIndex() {}
 
     virtual void build(const VSSDataset* base_dataset) = 0;
+    // 分块流式构建，返回 false 表示该索引不支持（重排序类索引查询时需要完整的序列数据）
+    virtual bool build_streaming(VSSChunkReader& reader) { return false; }
     virtual std::priority_queue<std::pair<float, int>> search(const float* q_data, int q_len, int k, int ef) = 0;
+
+    // 多个查询按 batch_threads 个线程并发执行，结果与输入顺序一致；要求 search 可并发调用
+    virtual std::vector<std::priority_queue<std::pair<float, int>>>
+    search_batch(const std::vector<std::pair<const float*, int>>& queries, int k, int ef, int batch_threads) {
+        std::vector<std::priority_queue<std::pair<float, int>>> results(queries.size());
+#pragma omp parallel for num_threads(batch_threads) schedule(dynamic, 1)
+        for (size_t i = 0; i < queries.size(); i++) {
+            results[i] = search(queries[i].first, queries[i].second, k, ef);
+        }
+        return results;
+    }
+
     virtual std::vector<std::pair<std::string, long>> get_metrics() { return {}; };
     virtual void reset_metrics() {};
+    // 最近一次构建的统计，构建完成后由 runner 输出
+    virtual std::vector<std::pair<std::string, long>> get_build_metrics() { return {}; };
+    virtual size_t get_memory_usage() { return 0; }
+
+    // 影响构建结果的参数，编码进缓存索引的文件名，参数不同的构建不会误用同一个文件
+    virtual std::string get_build_params() const { return ""; }
+
+    // 索引持久化，返回 false 表示不支持，或文件与当前参数、数据集不匹配（此时索引需要重新创建）
+    virtual bool save(const std::string& path) { return false; }
+    virtual bool load(const std::string& path, const VSSDataset* base_dataset) { return false; }
+};
+
+// 候选序列集合：按轮次标记的稠密访问数组去重，候选 id 紧凑存放，每次查询复用
+// 逐向量检索的索引还可以按查询向量投票，为每个候选累计近似距离 score
+class CandidateList {
+public:
+    typedef unsigned short tag_t;
+
+    size_t num_elements;
+    tag_t tag;
+    tag_t* mass;
+    std::vector<int> ids;
+
+    // 近似距离 = sum_i 第 i 个查询向量命中该序列的最小距离，未命中时以该查询向量返回结果中的最大距离补全
+    // score[id] 只记录命中项相对补全值的差，补全值之和统一记在 impute_sum
+    bool scored;
+    float impute_sum;
+    float* score;
+
+    tag_t token_tag;
+    tag_t* token_mass;
+    float* token_best;
+    std::vector<int> token_ids;
+
+    CandidateList()
+        : num_elements(0), tag(-1), mass(nullptr), score(nullptr), token_tag(-1), token_mass(nullptr),
+          token_best(nullptr) {}
+
+    CandidateList(size_t num_elements) : CandidateList() { resize(num_elements); }
+
+    void resize(size_t num_elements) {
+        delete[] mass;
+        delete[] score;
+        delete[] token_mass;
+        delete[] token_best;
+        this->num_elements = num_elements;
+        this->tag = -1;
+        this->mass = new tag_t[num_elements];
+        this->score = new float[num_elements];
+        this->token_tag = -1;
+        this->token_mass = new tag_t[num_elements];
+        this->token_best = new float[num_elements];
+        memset(mass, 0, sizeof(tag_t) * num_elements);
+        memset(token_mass, 0, sizeof(tag_t) * num_elements);
+        ids.clear();
+        ids.reserve(num_elements);
+    }
+
+    inline void reset() {
+        ids.clear();
+        scored = false;
+        impute_sum = 0.0f;
+        tag++;
+        if (tag == 0) {
+            tag = 1;
+            memset(mass, 0, sizeof(tag_t) * num_elements);
+        }
+    }
+
+    inline void insert(int id) {
+        if (mass[id] != tag) {
+            mass[id] = tag;
+            score[id] = 0.0f;
+            ids.push_back(id);
+        }
+    }
+
+    inline void begin_token() {
+        scored = true;
+        token_ids.clear();
+        token_tag++;
+        if (token_tag == 0) {
+            token_tag = 1;
+            memset(token_mass, 0, sizeof(tag_t) * num_elements);
+        }
+    }
+
+    inline void vote(int id, float dist) {
+        insert(id);
+        if (token_mass[id] != token_tag) {
+            token_mass[id] = token_tag;
+            token_best[id] = dist;
+            token_ids.push_back(id);
+        } else {
+            token_best[id] = std::min(token_best[id], dist);
+        }
+    }
+
+    // impute 为当前查询向量返回结果中的最大距离，是未命中序列真实最小距离的下界
+    inline void end_token(float impute) {
+        for (int id : token_ids) {
+            score[id] += std::min(token_best[id], impute) - impute;
+        }
+        impute_sum += impute;
+    }
+
+    // 只保留近似距离最小的 n 个候选
+    inline void truncate(size_t n) {
+        if (!scored || ids.size() <= n) {
+            return;
+        }
+        std::nth_element(ids.begin(), ids.begin() + n, ids.end(),
+                         [this](int a, int b) { return score[a] < score[b]; });
+        ids.resize(n);
+    }
+
+    // 按序列 id 排序，重排序时按内存顺序读取序列数据
+    inline void sort() { std::sort(ids.begin(), ids.end()); }
+
+    inline size_t size() const { return ids.size(); }
+
+    ~CandidateList() {
+        delete[] mass;
+        delete[] score;
+        delete[] token_mass;
+        delete[] token_best;
+    }
 };
 
 class RerankIndex : public VSSIndex {
@@ -26,21 +182,64 @@ public:
     std::vector<int> seq_len;
 
     std::vector<int> vec_to_seq;
+    // 每个查询从池中独占一个候选列表，支持并发查询
+    ListPool<CandidateList>* candidate_pool;
+    // 投票后进入精确重排序的候选数上限，0 表示不限制
+    int rerank_num;
+
+    ScalarQuantizer* quantizer;
+    std::vector<uint8_t> codes;
+    std::vector<const uint8_t*> seq_codes;
 
-    long metric_cand_num;
-    long metric_cand_gen_time;
-    long metric_rerank_time;
+    // DTW 重排序前的下界级联：LB_Kim -> LB_Keogh -> 完整 DTW
+    bool use_lower_bounds;
+    std::vector<float> seq_envelope;
+
+    std::atomic<long> metric_cand_voted;
+    std::atomic<long> metric_cand_num;
+    std::atomic<long> metric_cand_gen_time;
+    std::atomic<long> metric_rerank_time;
+    std::atomic<long> metric_lb_kim_pruned;
+    std::atomic<long> metric_lb_keogh_pruned;
 
     virtual void build_vectors(const float* data, int size) = 0;
-    virtual std::unordered_set<int> search_candidates(const float* q_data, int q_len, int q_k) = 0;
+    virtual bool save_vectors(const std::string& path) { return false; }
+    virtual bool load_vectors(const std::string& path) { return false; }
+    // 将候选序列 id 写入 candidates，调用前已 reset
+    virtual void search_candidates(const float* q_data, int q_len, int q_k, CandidateList& candidates) = 0;
+    // 精确重排序之前的可选近似评分阶段，可进一步缩减候选
+    virtual void shortlist(const float* q_data, int q_len, CandidateList& candidates) {}
+
+    RerankIndex(int dim, VSSSpace* space)
+        : VSSIndex(dim, space), candidate_pool(nullptr), rerank_num(0), quantizer(nullptr) {}
 
-    RerankIndex(int dim, VSSSpace* space) : VSSIndex(dim, space) {}
+    ~RerankIndex() {
+        delete candidate_pool;
+        delete quantizer;
+    }
 
     void build(const VSSDataset* base_dataset) override {
+        prepare(base_dataset);
+        build_vectors(base_dataset->data, base_dataset->size);
+    }
+
+    bool save(const std::string& path) override { return save_vectors(path); }
+
+    // 序列映射、量化编码和包络都由数据集线性时间重新计算，只有逐向量索引从文件加载
+    bool load(const std::string& path, const VSSDataset* base_dataset) override {
+        prepare(base_dataset);
+        return load_vectors(path);
+    }
+
+    void prepare(const VSSDataset* base_dataset) {
         seq_num = base_dataset->seq_num;
         seq_data = base_dataset->seq_data;
         seq_len = base_dataset->seq_len;
 
+        // build 和 load 都会调用 prepare，重复调用时释放之前的候选池和量化器
+        delete candidate_pool;
+        candidate_pool = new ListPool<CandidateList>(seq_num);
+
         vec_to_seq.resize(base_dataset->size);
         int label = 0;
         for (int i = 0; i < seq_num; i++) {
@@ -49,43 +248,191 @@ public:
             }
         }
 
-        build_vectors(base_dataset->data, base_dataset->size);
+        // 量化存储时重排序只读编码，不再访问 fp32 序列
+        delete quantizer;
+        quantizer = nullptr;
+        if (sq_type != SQ_NONE) {
+            quantizer = new ScalarQuantizer(dim, sq_type);
+            quantizer->train(base_dataset->data, base_dataset->size);
+            codes.resize((size_t)base_dataset->size * quantizer->code_size);
+            quantizer->encode(base_dataset->data, codes.data(), base_dataset->size);
+
+            seq_codes.resize(seq_num);
+            size_t offset = 0;
+            for (int i = 0; i < seq_num; i++) {
+                seq_codes[i] = codes.data() + offset * quantizer->code_size;
+                offset += seq_len[i];
+            }
+        }
+
+        // 包络基于重排序实际使用的（解码后的）数据计算，保证下界成立
+        use_lower_bounds = space->metric == DTW || space->metric == CDTW;
+        if (use_lower_bounds) {
+            seq_envelope.resize((size_t)seq_num * 2 * dim);
+            for (int i = 0; i < seq_num; i++) {
+                compute_envelope(sequence_data(i), seq_len[i], dim, seq_lower(i), seq_upper(i));
+            }
+        }
+    }
+
+    // 重排序使用的序列数据，量化存储时解码到线程私有缓冲区，下次调用前有效
+    inline const float* sequence_data(int id) const {
+        if (quantizer == nullptr) {
+            return seq_data[id];
+        }
+        float* data = thread_scratch<SCRATCH_DECODE>((size_t)seq_len[id] * dim);
+        quantizer->decode(seq_codes[id], data, seq_len[id]);
+        return data;
     }
 
+    inline float* seq_lower(int id) { return seq_envelope.data() + (size_t)id * 2 * dim; }
+
+    inline float* seq_upper(int id) { return seq_lower(id) + dim; }
+
     std::priority_queue<std::pair<float, int>> search(const float* q_data, int q_len, int k, int ef) override {
         auto begin = std::chrono::high_resolution_clock::now();
-        auto candidates = search_candidates(q_data, q_len, ef);
+        CandidateList& candidates = *candidate_pool->get();
+        candidates.reset();
+        search_candidates(q_data, q_len, ef, candidates);
+        return rerank(q_data, q_len, k, candidates, begin);
+    }
+
+    // 对已投票的候选截断、排序并精确重排序，之后把候选列表归还到池中；begin 为生成候选的开始时间
+    std::priority_queue<std::pair<float, int>>
+    rerank(const float* q_data, int q_len, int k, CandidateList& candidates,
+           std::chrono::high_resolution_clock::time_point begin) {
+        metric_cand_voted += candidates.size();
+        if (rerank_num > 0) {
+            candidates.truncate(rerank_num);
+        }
+        shortlist(q_data, q_len, candidates);
+        candidates.sort();
         auto mid = std::chrono::high_resolution_clock::now();
 
         std::priority_queue<std::pair<float, int>> result;
-        for (int id : candidates) {
-            float dist = space->distance(q_data, q_len, seq_data[id], seq_len[id]);
-            result.emplace(dist, id);
-            if (result.size() > k) {
-                result.pop();
+        if (num_threads > 1 && candidates.size() >= 2 * num_threads) {
+            rerank_parallel(q_data, q_len, k, candidates, result);
+        } else {
+            long kim_pruned = 0;
+            long keogh_pruned = 0;
+            for (int id : candidates.ids) {
+                float bound = result.size() < k ? std::numeric_limits<float>::infinity() : result.top().first;
+                float dist = rerank_distance(q_data, q_len, id, bound, kim_pruned, keogh_pruned);
+                if (dist > bound) {
+                    continue;
+                }
+                result.emplace(dist, id);
+                if (result.size() > k) {
+                    result.pop();
+                }
             }
+            metric_lb_kim_pruned += kim_pruned;
+            metric_lb_keogh_pruned += keogh_pruned;
         }
 
         auto end = std::chrono::high_resolution_clock::now();
         metric_cand_num += candidates.size();
+        candidate_pool->release(&candidates);
         metric_cand_gen_time += std::chrono::duration_cast<std::chrono::microseconds>(mid - begin).count();
         metric_rerank_time += std::chrono::duration_cast<std::chrono::microseconds>(end - mid).count();
 
         return result;
     }
 
+    // 下界级联 + 可提前终止的精确距离，被剪枝或超过 bound 时返回 INF
+    inline float rerank_distance(const float* q_data, int q_len, int id, float bound, long& kim_pruned,
+                                 long& keogh_pruned) {
+        const float* data = sequence_data(id);
+        if (use_lower_bounds && bound != std::numeric_limits<float>::infinity()) {
+            if (space->lower_bound_kim(q_data, q_len, data, seq_len[id]) > bound) {
+                kim_pruned++;
+                return std::numeric_limits<float>::infinity();
+            }
+            if (space->lower_bound_keogh(q_data, q_len, seq_lower(id), seq_upper(id)) > bound) {
+                keogh_pruned++;
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+        return space->distance_bounded(q_data, q_len, data, seq_len[id], bound);
+    }
+
+    // 候选按动态调度分给各线程，每个线程维护局部 top-k 后合并。
+    // 任一线程局部第 k 小的距离都不小于全局第 k 小，取其最小值作为共享 bound 仍可安全剪枝
+    void rerank_parallel(const float* q_data, int q_len, int k, const CandidateList& candidates,
+                         std::priority_queue<std::pair<float, int>>& result) {
+        const float INF = std::numeric_limits<float>::infinity();
+        std::atomic<float> shared_bound(INF);
+        long kim_pruned = 0;
+        long keogh_pruned = 0;
+
+#pragma omp parallel num_threads(num_threads) reduction(+ : kim_pruned, keogh_pruned)
+        {
+            std::priority_queue<std::pair<float, int>> local;
+#pragma omp for schedule(dynamic, 4) nowait
+            for (size_t c = 0; c < candidates.ids.size(); c++) {
+                int id = candidates.ids[c];
+                float bound = shared_bound.load(std::memory_order_relaxed);
+                if (local.size() >= k) {
+                    bound = std::min(bound, local.top().first);
+                }
+                float dist = rerank_distance(q_data, q_len, id, bound, kim_pruned, keogh_pruned);
+                if (dist > bound) {
+                    continue;
+                }
+                local.emplace(dist, id);
+                if (local.size() > k) {
+                    local.pop();
+                }
+                if (local.size() >= k) {
+                    float top = local.top().first;
+                    float cur = shared_bound.load(std::memory_order_relaxed);
+                    while (top < cur && !shared_bound.compare_exchange_weak(cur, top, std::memory_order_relaxed)) {
+                    }
+                }
+            }
+
+#pragma omp critical
+            {
+                while (!local.empty()) {
+                    result.push(local.top());
+                    local.pop();
+                    if (result.size() > k) {
+                        result.pop();
+                    }
+                }
+            }
+        }
+
+        metric_lb_kim_pruned += kim_pruned;
+        metric_lb_keogh_pruned += keogh_pruned;
+    }
+
+    // 重排序读取的序列数据按实际存储计入：fp32 序列由数据集持有但查询时必须常驻
+    size_t get_memory_usage() override {
+        size_t data_bytes = quantizer ? codes.size() : vec_to_seq.size() * dim * sizeof(float);
+        return data_bytes + vec_to_seq.size() * sizeof(int) + seq_envelope.size() * sizeof(float) +
+               seq_num * (sizeof(const float*) + sizeof(const uint8_t*) + sizeof(int) +
+                          2 * (sizeof(CandidateList::tag_t) + sizeof(float) + sizeof(int)));
+    }
+
     std::vector<std::pair<std::string, long>> get_metrics() override {
         return {
+            {"cand_voted", metric_cand_voted},
             {"cand_num", metric_cand_num},
             {"cand_gen_time", metric_cand_gen_time},
             {"rerank_time", metric_rerank_time},
+            {"lb_kim_pruned", metric_lb_kim_pruned},
+            {"lb_keogh_pruned", metric_lb_keogh_pruned},
         };
     }
 
     void reset_metrics() override {
+        metric_cand_voted = 0;
         metric_cand_num = 0;
         metric_cand_gen_time = 0;
         metric_rerank_time = 0;
+        metric_lb_kim_pruned = 0;
+        metric_lb_keogh_pruned = 0;
     }
 };
 
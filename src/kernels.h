@@ -0,0 +1,290 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <hnswlib/hnswlib.h>
+
+namespace vss {
+
+namespace simd {
+
+#if defined(USE_AVX512)
+typedef __m512 vec_t;
+constexpr int WIDTH = 16;
+constexpr int TILE_Q = 4; // 4x4 累加器 + 8 个操作数，32 个 zmm 寄存器放得下
+constexpr int TILE_D = 4;
+
+inline vec_t zero() { return _mm512_setzero_ps(); }
+inline vec_t load(const float* p) { return _mm512_loadu_ps(p); }
+inline vec_t sub(vec_t a, vec_t b) { return _mm512_sub_ps(a, b); }
+inline vec_t fmadd(vec_t a, vec_t b, vec_t c) { return _mm512_fmadd_ps(a, b, c); }
+inline float reduce_add(vec_t v) { return _mm512_reduce_add_ps(v); }
+#elif defined(USE_AVX)
+typedef __m256 vec_t;
+constexpr int WIDTH = 8;
+constexpr int TILE_Q = 4; // 4x2 累加器 + 6 个操作数，16 个 ymm 寄存器放得下
+constexpr int TILE_D = 2;
+
+inline vec_t zero() { return _mm256_setzero_ps(); }
+inline vec_t load(const float* p) { return _mm256_loadu_ps(p); }
+inline vec_t sub(vec_t a, vec_t b) { return _mm256_sub_ps(a, b); }
+#ifdef __FMA__
+inline vec_t fmadd(vec_t a, vec_t b, vec_t c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+inline vec_t fmadd(vec_t a, vec_t b, vec_t c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+inline float reduce_add(vec_t v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+#else
+constexpr int WIDTH = 0;
+constexpr int TILE_Q = 4;
+constexpr int TILE_D = 2;
+#endif
+
+} // namespace simd
+
+enum TileOp { TILE_IP, TILE_L2 };
+
+// 以下核函数中 DIM > 0 时维度为编译期常量，内层循环可完全展开；DIM = 0 时使用运行时的 dim
+template<int DIM>
+constexpr int fixed_dim(int dim) {
+    return DIM > 0 ? DIM : dim;
+}
+
+// 计算 QB 个查询向量与 DB 个数据向量两两之间的内积或 L2 平方距离，每个数据块只加载一次
+template<TileOp op, int QB, int DB, int DIM = 0>
+inline void pairwise_tile(const float* q, const float* d, int dim, float* out) {
+    dim = fixed_dim<DIM>(dim);
+    int k = 0;
+#if defined(USE_AVX)
+    simd::vec_t acc[QB][DB];
+    for (int a = 0; a < QB; a++) {
+        for (int b = 0; b < DB; b++) {
+            acc[a][b] = simd::zero();
+        }
+    }
+    for (; k + simd::WIDTH <= dim; k += simd::WIDTH) {
+        simd::vec_t vq[QB], vd[DB];
+        for (int a = 0; a < QB; a++) {
+            vq[a] = simd::load(q + a * dim + k);
+        }
+        for (int b = 0; b < DB; b++) {
+            vd[b] = simd::load(d + b * dim + k);
+        }
+        for (int a = 0; a < QB; a++) {
+            for (int b = 0; b < DB; b++) {
+                if constexpr (op == TILE_L2) {
+                    simd::vec_t diff = simd::sub(vq[a], vd[b]);
+                    acc[a][b] = simd::fmadd(diff, diff, acc[a][b]);
+                } else {
+                    acc[a][b] = simd::fmadd(vq[a], vd[b], acc[a][b]);
+                }
+            }
+        }
+    }
+    for (int a = 0; a < QB; a++) {
+        for (int b = 0; b < DB; b++) {
+            out[a * DB + b] = simd::reduce_add(acc[a][b]);
+        }
+    }
+#else
+    for (int a = 0; a < QB * DB; a++) {
+        out[a] = 0.0f;
+    }
+#endif
+    for (; k < dim; k++) {
+        for (int a = 0; a < QB; a++) {
+            for (int b = 0; b < DB; b++) {
+                if constexpr (op == TILE_L2) {
+                    float diff = q[a * dim + k] - d[b * dim + k];
+                    out[a * DB + b] += diff * diff;
+                } else {
+                    out[a * DB + b] += q[a * dim + k] * d[b * dim + k];
+                }
+            }
+        }
+    }
+}
+
+// QB 行查询向量对整个数据序列的距离矩阵，按行主序写入 out[a * len + j]
+template<TileOp op, int QB, int DIM = 0>
+inline void pairwise_rows(const float* q, const float* seq, int len, int dim, float* out) {
+    dim = fixed_dim<DIM>(dim);
+    constexpr int DB = simd::TILE_D;
+    float tile[QB * DB];
+
+    int j = 0;
+    const float* d = seq;
+    for (; j + DB <= len; j += DB, d += DB * dim) {
+        pairwise_tile<op, QB, DB, DIM>(q, d, dim, tile);
+        for (int a = 0; a < QB; a++) {
+            for (int b = 0; b < DB; b++) {
+                out[a * len + j + b] = tile[a * DB + b];
+            }
+        }
+    }
+    for (; j < len; j++, d += dim) {
+        pairwise_tile<op, QB, 1, DIM>(q, d, dim, tile);
+        for (int a = 0; a < QB; a++) {
+            out[a * len + j] = tile[a];
+        }
+    }
+}
+
+// 完整距离矩阵，按反对角线存放：格子 (i, j) 写入 out[(i + j) * len1 + i]，同一条反对角线上的格子连续
+template<TileOp op, int DIM = 0>
+inline void pairwise_matrix_diagonal(const float* seq1, int len1, const float* seq2, int len2, int dim, float* out) {
+    dim = fixed_dim<DIM>(dim);
+    constexpr int QB = simd::TILE_Q;
+    constexpr int DB = simd::TILE_D;
+    float tile[QB * DB];
+
+    for (int i = 0; i < len1; i += QB) {
+        const float* q = seq1 + (size_t)i * dim;
+        if (i + QB > len1) {
+            for (int a = i; a < len1; a++, q += dim) {
+                const float* d = seq2;
+                for (int j = 0; j < len2; j++, d += dim) {
+                    pairwise_tile<op, 1, 1, DIM>(q, d, dim, tile);
+                    out[(size_t)(a + j) * len1 + a] = tile[0];
+                }
+            }
+            break;
+        }
+
+        int j = 0;
+        const float* d = seq2;
+        for (; j + DB <= len2; j += DB, d += DB * dim) {
+            pairwise_tile<op, QB, DB, DIM>(q, d, dim, tile);
+            for (int a = 0; a < QB; a++) {
+                for (int b = 0; b < DB; b++) {
+                    out[(size_t)(i + a + j + b) * len1 + i + a] = tile[a * DB + b];
+                }
+            }
+        }
+        for (; j < len2; j++, d += dim) {
+            pairwise_tile<op, QB, 1, DIM>(q, d, dim, tile);
+            for (int a = 0; a < QB; a++) {
+                out[(size_t)(i + a + j) * len1 + i + a] = tile[a];
+            }
+        }
+    }
+}
+
+// QB 行查询向量对整个数据序列求最大内积，按 DB 列分块并在同一遍中做行最大值
+template<int QB, int DIM = 0>
+inline void max_inner_product_rows(const float* q, const float* seq, int len, int dim, float* row_max) {
+    dim = fixed_dim<DIM>(dim);
+    constexpr int DB = simd::TILE_D;
+    float tile[QB * DB];
+    for (int a = 0; a < QB; a++) {
+        row_max[a] = -std::numeric_limits<float>::infinity();
+    }
+
+    int j = 0;
+    const float* d = seq;
+    for (; j + DB <= len; j += DB, d += DB * dim) {
+        pairwise_tile<TILE_IP, QB, DB, DIM>(q, d, dim, tile);
+        for (int a = 0; a < QB; a++) {
+            for (int b = 0; b < DB; b++) {
+                row_max[a] = std::max(row_max[a], tile[a * DB + b]);
+            }
+        }
+    }
+    for (; j < len; j++, d += dim) {
+        pairwise_tile<TILE_IP, QB, 1, DIM>(q, d, dim, tile);
+        for (int a = 0; a < QB; a++) {
+            row_max[a] = std::max(row_max[a], tile[a]);
+        }
+    }
+}
+
+// MaxSim 距离，与逐对调用 hnswlib InnerProductDistance (1 - ip) 后取行最小再求和等价
+template<int DIM = 0>
+inline float maxsim_distance(const float* seq1, int len1, const float* seq2, int len2, int dim) {
+    dim = fixed_dim<DIM>(dim);
+    constexpr int QB = simd::TILE_Q;
+    float row_max[QB];
+    float sum = 0.0f;
+
+    int i = 0;
+    const float* q = seq1;
+    for (; i + QB <= len1; i += QB, q += QB * dim) {
+        max_inner_product_rows<QB, DIM>(q, seq2, len2, dim, row_max);
+        for (int a = 0; a < QB; a++) {
+            sum += 1.0f - row_max[a];
+        }
+    }
+    for (; i < len1; i++, q += dim) {
+        max_inner_product_rows<1, DIM>(q, seq2, len2, dim, row_max);
+        sum += 1.0f - row_max[0];
+    }
+    return sum;
+}
+
+template<int DIM = 0>
+inline float vector_norm(const float* v, int dim) {
+    dim = fixed_dim<DIM>(dim);
+    float ip;
+    pairwise_tile<TILE_IP, 1, 1, DIM>(v, v, dim, &ip);
+    return std::sqrt(ip);
+}
+
+// 可提前终止的 MaxSim：未处理的查询向量 q_i 满足 1 - ip(q_i, d_j) >= 1 - |q_i| * max_j |d_j|，
+// 已处理部分的精确和加上剩余部分的下界超过 bound 时直接返回。剩余下界用后缀和预先算好而不是逐行减去，
+// 比较时再留出浮点舍入的余量，保证距离不超过 bound 时一定返回精确值
+template<int DIM = 0>
+inline float maxsim_distance_bounded(const float* seq1, int len1, const float* seq2, int len2, int dim, float bound) {
+    dim = fixed_dim<DIM>(dim);
+    const float INF = std::numeric_limits<float>::infinity();
+    if (bound == INF) {
+        return maxsim_distance<DIM>(seq1, len1, seq2, len2, dim);
+    }
+
+    float max_norm2 = 0.0f;
+    const float* d = seq2;
+    for (int j = 0; j < len2; j++, d += dim) {
+        max_norm2 = std::max(max_norm2, vector_norm<DIM>(d, dim));
+    }
+
+    // remain[i] 为第 i 行及之后各行的下界之和，remain[len1] = 0
+    thread_local std::vector<float> remain;
+    remain.resize(len1 + 1);
+    remain[len1] = 0.0f;
+    for (int i = len1 - 1; i >= 0; i--) {
+        remain[i] = remain[i + 1] + 1.0f - vector_norm<DIM>(seq1 + (size_t)i * dim, dim) * max_norm2;
+    }
+    const float limit = bound + 1e-5f * (std::fabs(bound) + len1);
+
+    constexpr int QB = simd::TILE_Q;
+    float row_max[QB];
+    float sum = 0.0f;
+
+    int i = 0;
+    const float* q = seq1;
+    for (; i + QB <= len1; i += QB, q += QB * dim) {
+        max_inner_product_rows<QB, DIM>(q, seq2, len2, dim, row_max);
+        for (int a = 0; a < QB; a++) {
+            sum += 1.0f - row_max[a];
+        }
+        if (i + QB < len1 && sum + remain[i + QB] > limit) {
+            return INF;
+        }
+    }
+    for (; i < len1; i++, q += dim) {
+        max_inner_product_rows<1, DIM>(q, seq2, len2, dim, row_max);
+        sum += 1.0f - row_max[0];
+        if (i + 1 < len1 && sum + remain[i + 1] > limit) {
+            return INF;
+        }
+    }
+    return sum;
+}
+
+} // namespace vss
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vss {
+
+// 索引文件格式版本，文件布局变化时递增，版本不符的缓存会被重建
+constexpr uint64_t INDEX_FILE_VERSION = 3;
+
+// 只读方式整体映射一个文件，MAP_PRIVATE 下的写入不会落盘；不支持 mmap 的平台退化为一次性读入
+class MappedFile {
+public:
+    char* data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0) {}
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        FILE* f = fopen(path.c_str(), "rb");
+        if (f == nullptr) {
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        data = (char*)malloc(size);
+        bool ok = fread(data, 1, size, f) == size;
+        fclose(f);
+        if (!ok) {
+            close();
+        }
+        return ok;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = (char*)p;
+        return true;
+#endif
+    }
+
+    void close() {
+        if (data != nullptr) {
+#ifdef _WIN32
+            free(data);
+#else
+            munmap(data, size);
+#endif
+        }
+        data = nullptr;
+        size = 0;
+    }
+
+    bool is_open() const { return data != nullptr; }
+
+    ~MappedFile() { close(); }
+};
+
+template<typename T>
+inline void write_pod(std::ostream& out, const T& value) {
+    out.write((const char*)&value, sizeof(T));
+}
+
+// 从映射内存中顺序读取，越界时返回 false
+template<typename T>
+inline bool read_pod(const char*& cur, const char* end, T& value) {
+    if (cur + sizeof(T) > end) {
+        return false;
+    }
+    memcpy(&value, cur, sizeof(T));
+    cur += sizeof(T);
+    return true;
+}
+
+} // namespace vss
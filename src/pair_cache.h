@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+namespace vss {
+
+// 构建期的序列对距离缓存：按 id 对的哈希分片，每个分片是容量固定的开放寻址表，
+// 探测窗口内没有空位时覆盖窗口内的第一个位置，总内存有上界。
+// 带 bound 提前终止的计算只知道距离大于 bound，这类条目标记为非精确并记下该 bound，只能回答不超过它的 bound
+class PairDistanceCache {
+public:
+    static constexpr int NUM_SHARDS = 64;
+    static constexpr int PROBE = 4;
+    static constexpr uint64_t EMPTY_KEY = ~0ull;
+
+    struct Entry {
+        uint64_t key;
+        float dist;
+        bool exact;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::vector<Entry> entries;
+    };
+
+    size_t shard_capacity;
+    Shard* shards;
+
+    std::atomic<long> lookups;
+    std::atomic<long> hits;
+
+    PairDistanceCache(size_t capacity) {
+        this->shard_capacity = 1;
+        while (shard_capacity * NUM_SHARDS < capacity) {
+            shard_capacity *= 2;
+        }
+        this->shards = new Shard[NUM_SHARDS];
+        for (int i = 0; i < NUM_SHARDS; i++) {
+            shards[i].entries.assign(shard_capacity, {EMPTY_KEY, 0.0f, false});
+        }
+        this->lookups = 0;
+        this->hits = 0;
+    }
+
+    ~PairDistanceCache() { delete[] shards; }
+
+    static inline uint64_t pair_key(uint32_t id1, uint32_t id2) { return ((uint64_t)id1 << 32) | id2; }
+
+    static inline uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    bool lookup(uint64_t key, float bound, float& dist) {
+        lookups.fetch_add(1, std::memory_order_relaxed);
+        uint64_t h = hash(key);
+        Shard& shard = shards[h % NUM_SHARDS];
+        size_t slot = (h / NUM_SHARDS) & (shard_capacity - 1);
+        std::unique_lock<std::mutex> guard(shard.lock);
+        for (int i = 0; i < PROBE; i++) {
+            const Entry& e = shard.entries[(slot + i) & (shard_capacity - 1)];
+            if (e.key == EMPTY_KEY) {
+                return false;
+            }
+            if (e.key == key) {
+                if (e.exact || e.dist >= bound) {
+                    dist = e.exact ? e.dist : std::numeric_limits<float>::infinity();
+                    hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                return false;
+            }
+        }
+        return false;
+    }
+
+    void insert(uint64_t key, float dist, bool exact) {
+        uint64_t h = hash(key);
+        Shard& shard = shards[h % NUM_SHARDS];
+        size_t slot = (h / NUM_SHARDS) & (shard_capacity - 1);
+        std::unique_lock<std::mutex> guard(shard.lock);
+        Entry* target = &shard.entries[slot];
+        for (int i = 0; i < PROBE; i++) {
+            Entry& e = shard.entries[(slot + i) & (shard_capacity - 1)];
+            if (e.key == EMPTY_KEY || e.key == key) {
+                target = &e;
+                break;
+            }
+        }
+        *target = {key, dist, exact};
+    }
+
+    size_t memory_usage() const { return NUM_SHARDS * shard_capacity * sizeof(Entry); }
+};
+
+} // namespace vss
@@ -0,0 +1,153 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <hnswlib/hnswlib.h>
+
+namespace vss {
+
+enum SQType { SQ_NONE, SQ_8BIT, SQ_FP16 };
+
+inline SQType parse_sq_type(const std::string& name) {
+    if (name == "sq8") {
+        return SQ_8BIT;
+    } else if (name == "fp16") {
+        return SQ_FP16;
+    }
+    return SQ_NONE;
+}
+
+inline uint16_t float_to_half(float f) {
+#ifdef __F16C__
+    return _cvtss_sh(f, 0);
+#else
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (exp <= 0) {
+        return sign; // 下溢为 0
+    } else if (exp >= 31) {
+        return sign | 0x7c00; // 上溢为 inf
+    }
+    return sign | (exp << 10) | ((mant + 0x1000) >> 13);
+#endif
+}
+
+inline float half_to_float(uint16_t h) {
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0) {
+        x = sign; // 非规格化数按 0 处理
+    } else if (exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+#endif
+}
+
+// 逐维标量量化：SQ8 按训练得到的每维 [vmin, vmin + vdiff] 均匀量化到 8 bit，FP16 直接转半精度
+class ScalarQuantizer {
+public:
+    int dim;
+    SQType type;
+    size_t code_size;
+
+    std::vector<float> vmin;
+    std::vector<float> vdiff;
+
+    ScalarQuantizer(int dim, SQType type) : dim(dim), type(type) {
+        code_size = type == SQ_8BIT ? dim : dim * sizeof(uint16_t);
+        vmin.assign(dim, 0.0f);
+        vdiff.assign(dim, 1.0f);
+    }
+
+    void train(const float* data, size_t n) {
+        if (type != SQ_8BIT) {
+            return;
+        }
+        std::vector<float> vmax(dim, -std::numeric_limits<float>::infinity());
+        vmin.assign(dim, std::numeric_limits<float>::infinity());
+        const float* x = data;
+        for (size_t i = 0; i < n; i++, x += dim) {
+            for (int d = 0; d < dim; d++) {
+                vmin[d] = std::min(vmin[d], x[d]);
+                vmax[d] = std::max(vmax[d], x[d]);
+            }
+        }
+        for (int d = 0; d < dim; d++) {
+            vdiff[d] = std::max(vmax[d] - vmin[d], std::numeric_limits<float>::min());
+        }
+    }
+
+    void encode(const float* x, uint8_t* code, size_t n) const {
+        for (size_t i = 0; i < n; i++, x += dim, code += code_size) {
+            if (type == SQ_8BIT) {
+                for (int d = 0; d < dim; d++) {
+                    float v = (x[d] - vmin[d]) / vdiff[d] * 255.0f;
+                    code[d] = (uint8_t)std::min(255.0f, std::max(0.0f, std::round(v)));
+                }
+            } else {
+                uint16_t* h = (uint16_t*)code;
+                for (int d = 0; d < dim; d++) {
+                    h[d] = float_to_half(x[d]);
+                }
+            }
+        }
+    }
+
+    void save(std::ostream& out) const {
+        out.write((const char*)&dim, sizeof(int));
+        out.write((const char*)&type, sizeof(SQType));
+        out.write((const char*)vmin.data(), dim * sizeof(float));
+        out.write((const char*)vdiff.data(), dim * sizeof(float));
+    }
+
+    // 读入 save 写出的训练参数，维度或类型不符时返回 false
+    bool load(std::istream& in) {
+        int file_dim;
+        SQType file_type;
+        in.read((char*)&file_dim, sizeof(int));
+        in.read((char*)&file_type, sizeof(SQType));
+        if (!in || file_dim != dim || file_type != type) {
+            return false;
+        }
+        in.read((char*)vmin.data(), dim * sizeof(float));
+        in.read((char*)vdiff.data(), dim * sizeof(float));
+        return (bool)in;
+    }
+
+    void decode(const uint8_t* code, float* x, size_t n) const {
+        for (size_t i = 0; i < n; i++, x += dim, code += code_size) {
+            if (type == SQ_8BIT) {
+                for (int d = 0; d < dim; d++) {
+                    x[d] = vmin[d] + code[d] * (vdiff[d] / 255.0f);
+                }
+            } else {
+                const uint16_t* h = (const uint16_t*)code;
+                for (int d = 0; d < dim; d++) {
+                    x[d] = half_to_float(h[d]);
+                }
+            }
+        }
+    }
+};
+
+} // namespace vss
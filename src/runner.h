@@ -2,8 +2,8 @@
 #include <chrono>
 #include <filesystem>
 #include <functional>
+#include <random>
 #include <unordered_map>
-#include <unordered_set>
 
 #include "dataset.h"
 #include "index.h"
@@ -36,34 +36,71 @@ public:
     std::string metric_name;
     std::string data_dir;
     std::string index_name;
+    std::unordered_map<std::string, std::string> options;
+
+    std::string space_name;
 
     VSSDataset* base_dataset;
     VSSDataset* query_dataset;
-    std::vector<std::unordered_set<int>> groundtruth;
+    std::vector<std::vector<int>> groundtruth;
 
     VSSSpace* space;
     VSSIndex* index;
     std::vector<int> efs;
-
-    VSSRunner(int dim, std::string metric_name, std::string data_dir, std::string index_name)
-        : dim(dim), metric_name(metric_name), data_dir(data_dir), index_name(index_name) {
+    // ivfpq 在每个 nprobe 下各扫一遍 efs，其余索引为空
+    std::vector<int> nprobes;
+    // 大于 0 时所有查询通过 search_batch 以该线程数并发执行
+    int batch_threads;
+
+    VSSRunner(int dim, std::string metric_name, std::string data_dir, std::string index_name,
+              std::unordered_map<std::string, std::string> options = {})
+        : dim(dim), metric_name(metric_name), data_dir(data_dir), index_name(index_name), options(options) {
+        // 带约束的 DTW 以无约束 DTW 的真值计算召回率
+        std::string gt_name = metric_name == "cdtw" ? "dtw" : metric_name;
+        space_name = metric_name;
+
+        // mmap=1 时向量文件首次转换为稠密格式，之后直接映射
+        // stream=<序列数> 时 base 数据集在构建时分块读取，不整体载入
+        bool use_mmap = get_option("mmap", 0);
         fs::path data_path = fs::path("../datasets") / data_dir;
-        base_dataset = new VSSDataset(dim, data_path / "base.fvecs", data_path / "base.lens");
-        query_dataset = new VSSDataset(dim, data_path / "query.fvecs", data_path / "query.lens");
-        groundtruth = read_groundtruth(data_path / ("groundtruth-" + metric_name + ".ivecs"));
+        auto begin = std::chrono::high_resolution_clock::now();
+        base_dataset = nullptr;
+        if (get_option("stream", 0) == 0) {
+            base_dataset = new VSSDataset(dim, data_path / "base.fvecs", data_path / "base.lens", use_mmap);
+        }
+        query_dataset = new VSSDataset(dim, data_path / "query.fvecs", data_path / "query.lens", use_mmap);
+        groundtruth = read_groundtruth(data_path / ("groundtruth-" + gt_name + ".ivecs"));
         // groundtruth = read_groundtruth(data_path / "groundtruth.ivecs");
+        auto end = std::chrono::high_resolution_clock::now();
+        size_t time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+        std::cout << "Dataset Load Time: " << time << " us" << (use_mmap ? " (mmap)" : "") << ", RSS: "
+                  << get_rss_kb("VmRSS") / 1024.0 << " MB, Peak RSS: " << get_rss_kb("VmHWM") / 1024.0 << " MB"
+                  << std::endl;
 
-        if (metric_name == "maxsim") {
-            space = new MaxSimSpace(dim);
-        } else if (metric_name == "dtw") {
-            space = new DTWSpace(dim);
-        } else if (metric_name == "sdtw") {
-            space = new SDTWSpace(dim);
-        } else {
-            std::cerr << "Unknown similarity metric: " << metric_name << std::endl;
-            std::exit(-1);
+        space = create_space();
+        index = create_index();
+        batch_threads = get_option("batch_threads", 0);
+
+        std::time_t t = std::time(nullptr);
+        char buf[16];
+        std::strftime(buf, sizeof(buf), "%y%m%d-%H%M%S", std::localtime(&t));
+        log_time = buf;
+    }
+
+    // 从 /proc/self/status 读取内存占用（kB），其他平台返回 0
+    static long get_rss_kb(const std::string& field) {
+        std::ifstream in("/proc/self/status");
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, field.size() + 1, field + ":") == 0) {
+                return std::stol(line.substr(field.size() + 1));
+            }
         }
+        return 0;
+    }
 
+    VSSIndex* create_index() {
+        VSSIndex* index;
         if (index_name == "brute_force") {
             index = new BruteForceIndex(dim, space);
             efs = {0};
@@ -71,8 +108,10 @@ public:
             index = new HNSWPointwiseIndex(dim, space, 16, 200);
             efs = {10, 20, 40, 60, 80, 100, 200, 500, 1000, 1500, 2000, 3000, 4000, 5000};
         } else if (index_name == "ivfpq") {
-            index = new IVFPQPointwiseIndex(dim, space, 100, 8, 8);
+            // pq_m=<M> 为 PQ 子空间数，ADC 评分的精度随之提高
+            index = new IVFPQPointwiseIndex(dim, space, 100, get_option("pq_m", 8), 8);
             efs = {10, 20, 50, 100, 200, 500};
+            nprobes = {1, 5, 10, 20, 50};
         } else if (index_name == "single_hnsw") {
             index = new SingleHNSWIndex(dim, space, 16, 200);
             efs = {10, 20, 40, 60, 80, 100, 200, 500, 1000, 1500, 2000, 3000, 4000, 5000};
@@ -84,10 +123,100 @@ public:
             std::exit(-1);
         }
 
-        std::time_t t = std::time(nullptr);
-        char buf[16];
-        std::strftime(buf, sizeof(buf), "%y%m%d-%H%M%S", std::localtime(&t));
-        log_time = buf;
+        // 序列数据的标量量化方式：none | sq8 | fp16
+        std::string sq = get_option("sq", std::string("none"));
+        index->sq_type = parse_sq_type(sq);
+        if (index->sq_type == SQ_NONE && sq != "none") {
+            std::cerr << "Unknown sq type: " << sq << std::endl;
+            std::exit(-1);
+        }
+
+        index->num_threads = get_option("threads", 1);
+        index->build_threads = get_option("build_threads", 1);
+
+        // 逐向量检索的索引按投票得分只重排序前 rerank 个候选
+        if (RerankIndex* rerank_index = dynamic_cast<RerankIndex*>(index)) {
+            rerank_index->rerank_num = get_option("rerank", 0);
+        }
+        // hugepages=1 时 seg 的图和序列数据使用大页；proxy=<段数> 时先用分段均值摘要筛选邻居，
+        // proxy_ratio=<百分比> 为计算精确距离的邻居比例
+        if (MultiHNSWIndex* seg_index = dynamic_cast<MultiHNSWIndex*>(index)) {
+            seg_index->use_hugepages = get_option("hugepages", 0);
+            seg_index->proxy_segments = get_option("proxy", 0);
+            seg_index->proxy_ratio = get_option("proxy_ratio", 50) / 100.0f;
+            // 构建期序列对距离缓存的容量（MB），pair_cache=0 关闭
+            seg_index->pair_cache_mb = get_option("pair_cache", 64);
+        }
+        // nprobe=<N> 时 ivfpq 只用这一个 nprobe；train_size=<N> 时只用 N 个随机采样的向量训练；
+        // adc=<N> 时候选先在 PQ 编码上近似评分，只精确重排序前 N 个
+        if (IVFPQPointwiseIndex* ivf_index = dynamic_cast<IVFPQPointwiseIndex*>(index)) {
+            int nprobe = get_option("nprobe", 0);
+            if (nprobe > 0) {
+                nprobes = {nprobe};
+            }
+            ivf_index->train_size = get_option("train_size", 0);
+            ivf_index->adc_shortlist = get_option("adc", 0);
+        }
+        // token_batch=1 时 single_hnsw 的各查询 token 一起检索；reorder=1 时构建后按图上的局部性重排元素
+        if (SingleHNSWIndex* single_index = dynamic_cast<SingleHNSWIndex*>(index)) {
+            single_index->batch_tokens = get_option("token_batch", 0);
+            single_index->reorder = get_option("reorder", 0);
+        }
+        return index;
+    }
+
+    // 常用维度使用编译期特化的距离核，其余维度（或 static_dim=0 时）走运行时维度
+    VSSSpace* create_space() {
+        if (get_option("static_dim", 1)) {
+            switch (dim) {
+            case 128:
+                return create_space<128>();
+            case 384:
+                return create_space<384>();
+            case 768:
+                return create_space<768>();
+            case 1024:
+                return create_space<1024>();
+            }
+        }
+        return create_space<0>();
+    }
+
+    template<int DIM>
+    VSSSpace* create_space() {
+        if (metric_name == "maxsim") {
+            return new MaxSimSpace<DIM>(dim);
+        } else if (metric_name == "dtw") {
+            return new DTWSpace<DIM>(dim);
+        } else if (metric_name == "sdtw") {
+            return new SDTWSpace<DIM>(dim);
+        } else if (metric_name == "cdtw") {
+            int radius = get_option("radius", 8);
+            std::string band = get_option("band", std::string("sakoe"));
+            space_name = "cdtw-" + band + "-r" + std::to_string(radius);
+            if (band == "sakoe") {
+                return new CDTWSpace<DIM>(dim, radius, SAKOE_CHIBA);
+            } else if (band == "itakura") {
+                return new CDTWSpace<DIM>(dim, radius, ITAKURA);
+            } else {
+                std::cerr << "Unknown cdtw band: " << band << std::endl;
+                std::exit(-1);
+            }
+        } else {
+            std::cerr << "Unknown similarity metric: " << metric_name << std::endl;
+            std::exit(-1);
+        }
+        return nullptr;
+    }
+
+    int get_option(const std::string& name, int default_value) const {
+        auto it = options.find(name);
+        return it == options.end() ? default_value : std::stoi(it->second);
+    }
+
+    std::string get_option(const std::string& name, const std::string& default_value) const {
+        auto it = options.find(name);
+        return it == options.end() ? default_value : it->second;
     }
 
     ~VSSRunner() {
@@ -96,25 +225,162 @@ public:
         delete index;
     }
 
+    // 缓存的索引文件，文件名包含量化方式和索引的构建参数，数据集规模另在文件头中校验
+    fs::path get_index_path() const {
+        std::string sq = get_option("sq", std::string("none"));
+        std::string file_name = index_name + (sq == "none" ? "" : "-" + sq) + index->get_build_params() + ".index";
+        return fs::path("../index") / data_dir / space_name / file_name;
+    }
+
     void run_build() {
+        int chunk_seqs = get_option("stream", 0);
+        if (chunk_seqs > 0) {
+            run_build_streaming(chunk_seqs);
+            return;
+        }
+
+        // 参数一致的缓存索引直接加载（cache=0 时总是重新构建），加载失败时丢弃半成品重新构建
+        bool cache = get_option("cache", 1);
+        fs::path index_path = get_index_path();
+        if (cache && index->build_threads <= 1 && fs::exists(index_path)) {
+            auto begin = std::chrono::high_resolution_clock::now();
+            bool loaded = index->load(index_path.string(), base_dataset);
+            auto end = std::chrono::high_resolution_clock::now();
+            if (loaded) {
+                size_t time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+                std::cout << "Load Time: " << time << " us, from " << index_path << std::endl;
+                size_t memory = index->get_memory_usage();
+                std::cout << "Index Memory: " << memory << " bytes, " << memory / (1024.0 * 1024.0) << " MB"
+                          << std::endl;
+                std::cout << std::endl;
+                return;
+            }
+            std::cout << "Cached index " << index_path << " does not match, rebuilding" << std::endl;
+            delete index;
+            index = create_index();
+        }
+
+        // 多线程构建时先以 1, 2, 4, ... 个线程各构建一次，输出构建时间随线程数的变化
+        int build_threads = index->build_threads;
+        if (build_threads > 1) {
+            size_t serial_time = 0;
+            for (int t = 1; t < build_threads; t *= 2) {
+                VSSIndex* scaling_index = create_index();
+                scaling_index->build_threads = t;
+                size_t time = run_build_once(scaling_index);
+                serial_time = t == 1 ? time : serial_time;
+                std::cout << "Speedup: " << serial_time * 1.0 / time << std::endl;
+                delete scaling_index;
+            }
+            size_t time = run_build_once(index);
+            std::cout << "Speedup: " << serial_time * 1.0 / time << std::endl;
+        } else {
+            run_build_once(index);
+        }
+
+        size_t memory = index->get_memory_usage();
+        std::cout << "Index Memory: " << memory << " bytes, " << memory / (1024.0 * 1024.0)
+                  << " MB, RSS: " << get_rss_kb("VmRSS") / 1024.0 << " MB" << std::endl;
+
+        if (cache) {
+            fs::create_directories(index_path.parent_path());
+            if (index->save(index_path.string())) {
+                std::cout << "Index saved to " << index_path << std::endl;
+            }
+        }
+        std::cout << std::endl;
+    }
+
+    // 流式构建不读缓存（校验需要完整数据集），构建完成后仍会写出缓存
+    void run_build_streaming(int chunk_seqs) {
+        fs::path data_path = fs::path("../datasets") / data_dir;
+        VSSChunkReader reader(dim, data_path / "base.fvecs", data_path / "base.lens", chunk_seqs);
+
         auto begin = std::chrono::high_resolution_clock::now();
-        index->build(base_dataset);
+        bool built = index->build_streaming(reader);
         auto end = std::chrono::high_resolution_clock::now();
+        cerr_if(!built, "Index does not support streaming build: ", index_name);
+
         size_t time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-        std::cout << "Build Time: " << time << " us" << std::endl;
+        std::cout << "Build Time (streaming, " << chunk_seqs << " seqs/chunk, " << index->build_threads
+                  << " threads): " << time << " us, " << reader.seq_num * 1e6 / time << " seqs/s" << std::endl;
+        print_build_metrics(index);
+        size_t memory = index->get_memory_usage();
+        std::cout << "Index Memory: " << memory << " bytes, " << memory / (1024.0 * 1024.0) << " MB" << std::endl;
+        std::cout << "Peak RSS: " << get_rss_kb("VmHWM") / 1024.0 << " MB" << std::endl;
+
+        if (get_option("cache", 1)) {
+            fs::path index_path = get_index_path();
+            fs::create_directories(index_path.parent_path());
+            if (index->save(index_path.string())) {
+                std::cout << "Index saved to " << index_path << std::endl;
+            }
+        }
         std::cout << std::endl;
     }
 
+    size_t run_build_once(VSSIndex* index) {
+        auto begin = std::chrono::high_resolution_clock::now();
+        index->build(base_dataset);
+        auto end = std::chrono::high_resolution_clock::now();
+        size_t time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+        std::cout << "Build Time (" << index->build_threads << " threads): " << time << " us, "
+                  << base_dataset->seq_num * 1e6 / time << " seqs/s" << std::endl;
+        print_build_metrics(index);
+        return time;
+    }
+
+    void print_build_metrics(VSSIndex* index) const {
+        for (const auto& [name, value] : index->get_build_metrics()) {
+            std::cout << "Build Metric (" << name << "): " << value << std::endl;
+        }
+    }
+
     void run_search() {
+        IVFPQPointwiseIndex* ivf_index = dynamic_cast<IVFPQPointwiseIndex*>(index);
+        if (ivf_index == nullptr || nprobes.empty()) {
+            run_search_efs("");
+            return;
+        }
+        // 每个 nprobe 的记录单独写一个文件，作图时各自成一条曲线
+        for (int nprobe : nprobes) {
+            ivf_index->nprobe = nprobe;
+            std::cout << "NProbe: " << nprobe << std::endl;
+            run_search_efs("-np" + std::to_string(nprobe));
+        }
+    }
+
+    void run_search_efs(const std::string& record_suffix) {
         std::vector<QueryRecord> records;
         int k = groundtruth[0].size();
 
         for (int i = 0; i < efs.size(); i++) {
+            // 多线程查询时先用单线程跑一遍作为基准，记录加速比
+            bool parallel = index->num_threads > 1 || batch_threads > 1;
+            size_t serial_time = 0;
+            if (parallel) {
+                int num_threads = index->num_threads;
+                int num_batch_threads = batch_threads;
+                index->num_threads = 1;
+                batch_threads = std::min(batch_threads, 1);
+                serial_time = run_search_once(k, efs[i]).time;
+                index->num_threads = num_threads;
+                batch_threads = num_batch_threads;
+            }
+
             QueryRecord r = run_search_once(k, efs[i]);
+            if (parallel) {
+                r.metrics.push_back({"serial_time", serial_time});
+            }
             records.push_back(r);
 
             std::cout << "EF: " << r.ef << std::endl;
             std::cout << "Time: " << r.time << " us, " << r.time / r.q_num << " us" << std::endl;
+            std::cout << "QPS: " << r.q_num * 1e6 / r.time << std::endl;
+            if (parallel) {
+                std::cout << "Speedup (" << std::max(index->num_threads, batch_threads)
+                          << " threads): " << serial_time * 1.0 / r.time << std::endl;
+            }
             std::cout << "Recall: " << r.hit << "/" << r.total << "=" << r.hit * 1.0 / r.total << std::endl;
             for (const auto& [name, value] : r.metrics) {
                 std::cout << "Metric (" << name << "): " << value << ", " << value / r.q_num << std::endl;
@@ -126,10 +392,14 @@ public:
             }
         }
 
-        save_records(records);
+        save_records(records, record_suffix);
     }
 
     QueryRecord run_search_once(int k, int ef) {
+        if (batch_threads > 0) {
+            return run_search_batch(k, ef);
+        }
+
         QueryRecord record = {};
         record.ef = ef;
         index->reset_metrics();
@@ -151,14 +421,47 @@ public:
             }
 
             assert(result.size() <= k);
-            while (result.size() > 0) {
-                int id = result.top().second;
-                result.pop();
-                if (groundtruth[i].find(id) != groundtruth[i].end()) {
-                    record.hit++;
-                }
+            record.hit += count_hits(i, result);
+            record.total += groundtruth[i].size();
+            record.q_num++;
+        }
+
+        return record;
+    }
+
+    int count_hits(int q_id, std::priority_queue<std::pair<float, int>>& result) const {
+        int hit = 0;
+        const std::vector<int>& gt = groundtruth[q_id];
+        while (result.size() > 0) {
+            int id = result.top().second;
+            result.pop();
+            if (std::binary_search(gt.begin(), gt.end(), id)) {
+                hit++;
             }
+        }
+        return hit;
+    }
+
+    // 批量并发查询，time 为整批查询的墙钟时间
+    QueryRecord run_search_batch(int k, int ef) {
+        QueryRecord record = {};
+        record.ef = ef;
+
+        std::vector<std::pair<const float*, int>> queries;
+        for (int i = 0; i < query_dataset->seq_num; i++) {
+            queries.push_back(query_dataset->get_data_len(i));
+        }
+
+        index->reset_metrics();
+        auto begin = std::chrono::high_resolution_clock::now();
+        auto results = index->search_batch(queries, k, ef, batch_threads);
+        auto end = std::chrono::high_resolution_clock::now();
+        record.time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+        record.metrics = index->get_metrics();
 
+        for (int i = 0; i < results.size(); i++) {
+            assert(results[i].size() <= k);
+            record.hit += count_hits(i, results[i]);
             record.total += groundtruth[i].size();
             record.q_num++;
         }
@@ -166,9 +469,119 @@ public:
         return record;
     }
 
-    void save_records(std::vector<QueryRecord>& records) {
-        std::string csv_name = index_name + "-search-" + log_time + ".csv";
-        fs::path csv_path = fs::path("../log") / data_dir / metric_name / csv_name;
+    // 插入/删除/查询混合负载：先用前 80% 的序列构建，之后每轮追加一批剩余序列、随机删除同样数量的存活序列，
+    // 再以固定 ef 跑一遍全部查询，每 repair 轮做一次修复（repair<=0 时从不修复）。删除会改变真值，召回只统计仍存活的真值邻居：
+    // 删除只会让存活的真值邻居排名提前，它们一定仍在当前数据的 top-k 中
+    void run_mixed(int rounds) {
+        MultiHNSWIndex* seg_index = dynamic_cast<MultiHNSWIndex*>(index);
+        cerr_if(seg_index == nullptr || base_dataset == nullptr, "Mixed workload requires the seg index without stream");
+        int ef = get_option("ef", 100);
+        int repair_interval = get_option("repair", 2);
+        int k = groundtruth[0].size();
+
+        int seq_num = base_dataset->seq_num;
+        int initial = seq_num * 4 / 5;
+        int batch = (seq_num - initial + rounds - 1) / rounds;
+
+        // 索引 id 按插入顺序分配，index_to_seq 记录其对应的数据集序列
+        std::vector<int> index_to_seq(initial);
+        std::vector<char> seq_live(seq_num, 0);
+        for (int i = 0; i < initial; i++) {
+            index_to_seq[i] = i;
+            seq_live[i] = 1;
+        }
+        std::vector<int> live_ids = index_to_seq;
+        std::default_random_engine rng(100);
+
+        auto begin = std::chrono::high_resolution_clock::now();
+        seg_index->build_prefix(base_dataset, initial);
+        auto end = std::chrono::high_resolution_clock::now();
+        size_t time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+        std::cout << "Build Time (" << initial << " seqs): " << time << " us" << std::endl << std::endl;
+
+        for (int round = 0; round <= rounds; round++) {
+            size_t insert_time = 0, remove_time = 0, repair_time = 0;
+            int inserted = 0, removed = 0;
+            size_t repaired = 0;
+            if (round > 0) {
+                int next_seq = initial + (round - 1) * batch;
+                begin = std::chrono::high_resolution_clock::now();
+                for (int s = next_seq; s < std::min(next_seq + batch, seq_num); s++) {
+                    int id = seg_index->insert(base_dataset->seq_data[s], base_dataset->seq_len[s]);
+                    index_to_seq.push_back(s);
+                    live_ids.push_back(id);
+                    seq_live[s] = 1;
+                    inserted++;
+                }
+                end = std::chrono::high_resolution_clock::now();
+                insert_time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+
+                for (; removed < batch && !live_ids.empty(); removed++) {
+                    int pos = std::uniform_int_distribution<int>(0, live_ids.size() - 1)(rng);
+                    int id = live_ids[pos];
+                    live_ids[pos] = live_ids.back();
+                    live_ids.pop_back();
+                    seq_live[index_to_seq[id]] = 0;
+                    begin = std::chrono::high_resolution_clock::now();
+                    seg_index->remove(id);
+                    end = std::chrono::high_resolution_clock::now();
+                    remove_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+                }
+
+                if (repair_interval > 0 && round % repair_interval == 0) {
+                    begin = std::chrono::high_resolution_clock::now();
+                    repaired = seg_index->repair();
+                    end = std::chrono::high_resolution_clock::now();
+                    repair_time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+                }
+            }
+
+            size_t search_time = 0;
+            int hit = 0, total = 0;
+            for (int i = 0; i < query_dataset->seq_num; i++) {
+                auto [q_data, q_len] = query_dataset->get_data_len(i);
+                begin = std::chrono::high_resolution_clock::now();
+                auto result = index->search(q_data, q_len, k, ef);
+                end = std::chrono::high_resolution_clock::now();
+                search_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+
+                const std::vector<int>& gt = groundtruth[i];
+                for (int id : gt) {
+                    total += seq_live[id];
+                }
+                while (!result.empty()) {
+                    hit += std::binary_search(gt.begin(), gt.end(), index_to_seq[result.top().second]);
+                    result.pop();
+                }
+            }
+
+            std::cout << "Round " << round << ": " << live_ids.size() << " live, " << seg_index->hnsw->num_deleted
+                      << " deleted" << std::endl;
+            if (round > 0) {
+                std::cout << "Insert: " << inserted << " seqs, " << insert_time / std::max(inserted, 1) << " us/seq"
+                          << std::endl;
+                std::cout << "Remove: " << removed << " seqs, " << remove_time << " us" << std::endl;
+                if (repair_time > 0) {
+                    std::cout << "Repair: " << repaired << " lists, " << repair_time << " us" << std::endl;
+                }
+            }
+            std::cout << "Search (ef " << ef << "): " << search_time / query_dataset->seq_num << " us/query"
+                      << std::endl;
+            std::cout << "Index Memory: " << index->get_memory_usage() << " bytes" << std::endl;
+            std::cout << "Recall: " << hit << "/" << total << "=" << hit * 1.0 / total << std::endl << std::endl;
+        }
+    }
+
+    void save_records(std::vector<QueryRecord>& records, const std::string& suffix) {
+        std::string sq = get_option("sq", std::string("none"));
+        int rerank = get_option("rerank", 0);
+        int threads = get_option("threads", 1);
+        std::string csv_name = index_name + (sq == "none" ? "" : "-" + sq) +
+                               (rerank == 0 ? "" : "-rerank" + std::to_string(rerank)) +
+                               (threads == 1 ? "" : "-t" + std::to_string(threads)) +
+                               (batch_threads == 0 ? "" : "-b" + std::to_string(batch_threads)) + suffix + "-search-" +
+                               log_time + ".csv";
+        fs::path csv_path = fs::path("../log") / data_dir / space_name / csv_name;
         fs::create_directories(csv_path.parent_path());
 
         std::ofstream ofs(csv_path);
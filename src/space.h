@@ -1,13 +1,29 @@
 #pragma once
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include <vector>
 
 #include <hnswlib/hnswlib.h>
 
+#include "kernels.h"
+#include "quantizer.h"
+
 namespace vss {
 
-enum VSSMetric { MAXSIM, DTW, SDTW };
+enum VSSMetric { MAXSIM, DTW, SDTW, CDTW };
+
+enum ScratchSlot { SCRATCH_DP, SCRATCH_COST, SCRATCH_DECODE, SCRATCH_DECODE_QUERY, SCRATCH_ADC };
+
+// 线程私有的临时缓冲区，容量随见过的最长序列增长且不释放，热路径上不再分配内存
+template<ScratchSlot slot>
+inline float* thread_scratch(size_t size) {
+    thread_local std::vector<float> buffer;
+    if (buffer.size() < size) {
+        buffer.resize(size);
+    }
+    return buffer.data();
+}
 
 class VSSSpace {
 public:
@@ -25,45 +41,304 @@ public:
         dist_func_param = space->get_dist_func_param();
     }
 
-    ~VSSSpace() { delete space; }
+    virtual ~VSSSpace() { delete space; }
 
     virtual float distance(const float* seq1, int len1, const float* seq2, int len2) const = 0;
+
+    // 已知距离超过 bound 即可丢弃时使用：结果不超过 bound 时为精确距离，否则只保证大于 bound
+    virtual float distance_bounded(const float* seq1, int len1, const float* seq2, int len2, float bound) const {
+        return distance(seq1, len1, seq2, len2);
+    }
+
+    // 非对称距离：fp32 的 seq1 对量化存储的 seq2。seq2 先整条解码到线程私有缓冲区再走 fp32 核，
+    // 解码开销 O(len2 * dim)，相对距离本身的 O(len1 * len2 * dim) 可以忽略
+    float distance_quantized(const float* seq1, int len1, const uint8_t* codes2, int len2, const ScalarQuantizer* sq,
+                             float bound) const {
+        float* seq2 = thread_scratch<SCRATCH_DECODE>((size_t)len2 * dim);
+        sq->decode(codes2, seq2, len2);
+        return distance_bounded(seq1, len1, seq2, len2, bound);
+    }
+
+    // 由逐点代价矩阵（len1 x len2 按行存放）聚合出序列距离，逐点代价与本空间一致：MaxSim 为 1 - ip，DTW 类为 L2 平方。
+    // 用于代价由其他途径（如 PQ 编码查表）近似得到的情形
+    virtual float distance_from_costs(const float* cost, int len1, int len2) const = 0;
+
+    // 常数时间下界，默认无下界
+    virtual float lower_bound_kim(const float* seq1, int len1, const float* seq2, int len2) const { return 0.0f; }
+
+    // 基于 seq2 逐维包络 [lower, upper] 的下界，默认无下界
+    virtual float lower_bound_keogh(const float* seq1, int len1, const float* lower, const float* upper) const {
+        return 0.0f;
+    }
 };
 
+// 逐维包络：lower/upper 为序列在每一维上的最小/最大值
+inline void compute_envelope(const float* seq, int len, int dim, float* lower, float* upper) {
+    std::fill(lower, lower + dim, std::numeric_limits<float>::infinity());
+    std::fill(upper, upper + dim, -std::numeric_limits<float>::infinity());
+    const float* v = seq;
+    for (int i = 0; i < len; i++, v += dim) {
+        for (int d = 0; d < dim; d++) {
+            lower[d] = std::min(lower[d], v[d]);
+            upper[d] = std::max(upper[d], v[d]);
+        }
+    }
+}
+
+// 超过该格子数且不需要提前终止时，DTW/SDTW 改用反对角线（波前）递推
+constexpr long WAVEFRONT_MIN_CELLS = 32 * 32;
+
+// 逐行递推：每 TILE_Q 行用分块核一次算出代价，整行超过 bound 时提前终止
+// subsequence 为 true 时为 SDTW：第 0 行全为 0，结果取最后一行最小值
+template<bool subsequence, int DIM = 0>
+inline float dtw_rows(const float* seq1, int len1, const float* seq2, int len2, int dim, float bound) {
+    dim = fixed_dim<DIM>(dim);
+    const float INF = std::numeric_limits<float>::infinity();
+    constexpr int QB = simd::TILE_Q;
+    float* pre = thread_scratch<SCRATCH_DP>(2 * (len2 + 1));
+    float* cur = pre + len2 + 1;
+    float* cost = thread_scratch<SCRATCH_COST>(QB * len2);
+    std::fill(pre, pre + len2 + 1, subsequence ? 0.0f : INF);
+    pre[0] = 0;
+
+    for (int i = 0; i < len1; i += QB) {
+        int rows = std::min(QB, len1 - i);
+        if (rows == QB) {
+            pairwise_rows<TILE_L2, QB, DIM>(seq1 + (size_t)i * dim, seq2, len2, dim, cost);
+        } else {
+            for (int r = 0; r < rows; r++) {
+                pairwise_rows<TILE_L2, 1, DIM>(seq1 + (size_t)(i + r) * dim, seq2, len2, dim, cost + r * len2);
+            }
+        }
+
+        for (int r = 0; r < rows; r++) {
+            const float* c = cost + r * len2;
+            cur[0] = INF;
+            float row_min = INF;
+            for (int j = 1; j <= len2; j++) {
+                cur[j] = c[j - 1] + std::min({pre[j], cur[j - 1], pre[j - 1]});
+                row_min = std::min(row_min, cur[j]);
+            }
+            // 代价非负，路径必经每一行，整行超过 bound 则最终距离也超过
+            if (row_min > bound) {
+                return INF;
+            }
+            std::swap(pre, cur);
+        }
+    }
+    return subsequence ? *std::min_element(pre + 1, pre + len2 + 1) : pre[len2];
+}
+
+// 给定完整代价矩阵的逐行递推，subsequence 含义同 dtw_rows
+template<bool subsequence>
+inline float dtw_from_costs(const float* cost, int len1, int len2) {
+    const float INF = std::numeric_limits<float>::infinity();
+    float* pre = thread_scratch<SCRATCH_DP>(2 * (len2 + 1));
+    float* cur = pre + len2 + 1;
+    std::fill(pre, pre + len2 + 1, subsequence ? 0.0f : INF);
+    pre[0] = 0;
+    for (int i = 0; i < len1; i++) {
+        const float* c = cost + (size_t)i * len2;
+        cur[0] = INF;
+        for (int j = 1; j <= len2; j++) {
+            cur[j] = c[j - 1] + std::min({pre[j], cur[j - 1], pre[j - 1]});
+        }
+        std::swap(pre, cur);
+    }
+    return subsequence ? *std::min_element(pre + 1, pre + len2 + 1) : pre[len2];
+}
+
+// 反对角线递推：第 k 条反对角线上的格子只依赖 k-1、k-2 两条，沿 i 方向没有数据依赖，内层循环可向量化
+// 三个缓冲区按绝对行号 i 索引，每条对角线两端额外写入边界值
+template<bool subsequence, int DIM = 0>
+inline float dtw_wavefront(const float* seq1, int len1, const float* seq2, int len2, int dim) {
+    dim = fixed_dim<DIM>(dim);
+    const float INF = std::numeric_limits<float>::infinity();
+    float* cost = thread_scratch<SCRATCH_COST>((size_t)(len1 + len2 - 1) * len1);
+    pairwise_matrix_diagonal<TILE_L2, DIM>(seq1, len1, seq2, len2, dim, cost);
+
+    float* buffer = thread_scratch<SCRATCH_DP>(3 * (len1 + 2));
+    float* prev2 = buffer;
+    float* prev1 = buffer + len1 + 2;
+    float* cur = buffer + 2 * (len1 + 2);
+
+    // 对角线 0: D[0][0]；对角线 1: D[0][1], D[1][0]
+    prev2[0] = 0.0f;
+    prev2[1] = INF;
+    prev1[0] = subsequence ? 0.0f : INF;
+    prev1[1] = INF;
+    prev1[2] = INF;
+
+    float result = INF;
+    for (int k = 2; k <= len1 + len2; k++) {
+        int lo = std::max(1, k - len2);
+        int hi = std::min(len1, k - 1);
+        const float* c = cost + (size_t)(k - 2) * len1;
+        for (int i = lo; i <= hi; i++) {
+            cur[i] = c[i - 1] + std::min(std::min(prev1[i - 1], prev1[i]), prev2[i - 1]);
+        }
+        // lo - 1 为第 0 行或第 len2 + 1 列，hi + 1 为第 0 列或第 len1 + 1 行
+        cur[lo - 1] = subsequence && lo == 1 ? 0.0f : INF;
+        cur[hi + 1] = INF;
+        if (subsequence && hi == len1) {
+            result = std::min(result, cur[len1]);
+        }
+
+        float* tmp = prev2;
+        prev2 = prev1;
+        prev1 = cur;
+        cur = tmp;
+    }
+    return subsequence ? result : prev1[len1];
+}
+
+// DIM > 0 时按编译期维度特化，序列距离循环内联定长的内积 / L2 核
+template<int DIM = 0>
 class MaxSimSpace : public VSSSpace {
 public:
     MaxSimSpace(int dim) : VSSSpace(dim, MAXSIM, new hnswlib::InnerProductSpace(dim)) {}
 
     float distance(const float* seq1, int len1, const float* seq2, int len2) const override {
+        return maxsim_distance<DIM>(seq1, len1, seq2, len2, dim);
+    }
+
+    float distance_bounded(const float* seq1, int len1, const float* seq2, int len2, float bound) const override {
+        return maxsim_distance_bounded<DIM>(seq1, len1, seq2, len2, dim, bound);
+    }
+
+    float distance_from_costs(const float* cost, int len1, int len2) const override {
         float sum = 0.0f;
+        for (int i = 0; i < len1; i++) {
+            sum += *std::min_element(cost + (size_t)i * len2, cost + (size_t)(i + 1) * len2);
+        }
+        return sum;
+    }
+};
+
+template<int DIM = 0>
+class DTWSpace : public VSSSpace {
+public:
+    DTWSpace(int dim, VSSMetric metric = DTW) : VSSSpace(dim, metric, new hnswlib::L2Space(dim)) {}
+
+    float distance(const float* seq1, int len1, const float* seq2, int len2) const override {
+        return distance_bounded(seq1, len1, seq2, len2, std::numeric_limits<float>::infinity());
+    }
+
+    float distance_bounded(const float* seq1, int len1, const float* seq2, int len2, float bound) const override {
+        if (bound == std::numeric_limits<float>::infinity() && (long)len1 * len2 >= WAVEFRONT_MIN_CELLS) {
+            return dtw_wavefront<false, DIM>(seq1, len1, seq2, len2, dim);
+        }
+        return dtw_rows<false, DIM>(seq1, len1, seq2, len2, dim, bound);
+    }
+
+    float distance_from_costs(const float* cost, int len1, int len2) const override {
+        return dtw_from_costs<false>(cost, len1, len2);
+    }
+
+    // LB_Kim：首尾两对向量一定在规整路径上
+    float lower_bound_kim(const float* seq1, int len1, const float* seq2, int len2) const override {
+        float lb;
+        pairwise_tile<TILE_L2, 1, 1, DIM>(seq1, seq2, dim, &lb);
+        if (len1 > 1 || len2 > 1) {
+            float last;
+            pairwise_tile<TILE_L2, 1, 1, DIM>(seq1 + (len1 - 1) * dim, seq2 + (len2 - 1) * dim, dim, &last);
+            lb += last;
+        }
+        return lb;
+    }
+
+    // LB_Keogh：seq1 的每个向量至少与 seq2 的一个向量匹配，其 L2 代价不小于到 seq2 包络的距离
+    float lower_bound_keogh(const float* seq1, int len1, const float* lower, const float* upper) const override {
+        const int dim = fixed_dim<DIM>(this->dim);
+        float lb = 0.0f;
         const float* v1 = seq1;
         for (int i = 0; i < len1; i++, v1 += dim) {
-            float sim = std::numeric_limits<float>::infinity();
-            const float* v2 = seq2;
-            for (int j = 0; j < len2; j++, v2 += dim) {
-                sim = std::min(sim, dist_func(v1, v2, dist_func_param));
+            for (int d = 0; d < dim; d++) {
+                float t = v1[d] > upper[d] ? v1[d] - upper[d] : (v1[d] < lower[d] ? lower[d] - v1[d] : 0.0f);
+                lb += t * t;
             }
-            sum += sim;
         }
-        return sum;
+        return lb;
     }
 };
 
-class DTWSpace : public VSSSpace {
+enum CDTWBand { SAKOE_CHIBA, ITAKURA };
+
+// 带约束的 DTW：只计算规整窗口内的格子，LB_Kim / LB_Keogh 仍是其下界
+template<int DIM = 0>
+class CDTWSpace : public DTWSpace<DIM> {
 public:
-    DTWSpace(int dim) : VSSSpace(dim, DTW, new hnswlib::L2Space(dim)) {}
+    int radius;
+    CDTWBand band;
+
+    CDTWSpace(int dim, int radius, CDTWBand band = SAKOE_CHIBA) : DTWSpace<DIM>(dim, CDTW), radius(radius), band(band) {}
+
+    // 第 i 行 (1-based) 的窗口 [lo, hi]：Sakoe-Chiba 为按长度缩放后的对角线两侧各 radius 格；ITAKURA 再与斜率限制在
+    // [1/2, 2] 的平行四边形取交集。两者最后都与缩放后对角线经过的格子取并集，lo/hi 随 i 单调不减，相邻两行的窗口
+    // 首尾相接，保证 (1, 1) 到 (len1, len2) 始终可达
+    inline void window(int i, int len1, int len2, int& lo, int& hi) const {
+        int diag_lo = (i - 1) * len2 / len1 + 1;
+        int diag_hi = (i * len2 + len1 - 1) / len1;
+        lo = std::max(1, diag_lo - radius);
+        hi = std::min(len2, diag_hi + radius);
+        if (band == ITAKURA) {
+            const float slope = 2.0f;
+            float x = (float)i / len1;
+            float y_lo = std::max(x / slope, 1.0f - slope * (1.0f - x));
+            float y_hi = std::min(x * slope, 1.0f - (1.0f - x) / slope);
+            lo = std::max(lo, (int)std::ceil(y_lo * len2));
+            hi = std::min(hi, (int)std::floor(y_hi * len2));
+        }
+        lo = std::min(lo, diag_lo);
+        hi = std::max(hi, diag_hi);
+    }
 
     float distance(const float* seq1, int len1, const float* seq2, int len2) const override {
+        return distance_bounded(seq1, len1, seq2, len2, std::numeric_limits<float>::infinity());
+    }
+
+    float distance_bounded(const float* seq1, int len1, const float* seq2, int len2, float bound) const override {
         const float INF = std::numeric_limits<float>::infinity();
-        std::vector<float> pre(len2 + 1, INF), cur(len2 + 1, INF);
+        const int dim = fixed_dim<DIM>(this->dim);
+        float* pre = thread_scratch<SCRATCH_DP>(2 * (len2 + 1));
+        float* cur = pre + len2 + 1;
+        float* cost = thread_scratch<SCRATCH_COST>(len2);
+        std::fill(pre, pre + 2 * (len2 + 1), INF);
         pre[0] = 0;
 
+        // 窗口单调，窗口外的格子要么从未写过（保持 INF），要么不会再被读到
         const float* v1 = seq1;
         for (int i = 1; i <= len1; i++, v1 += dim) {
-            cur[0] = INF;
-            const float* v2 = seq2;
-            for (int j = 1; j <= len2; j++, v2 += dim) {
-                cur[j] = dist_func(v1, v2, dist_func_param) + std::min({pre[j], cur[j - 1], pre[j - 1]});
+            int lo, hi;
+            window(i, len1, len2, lo, hi);
+            pairwise_rows<TILE_L2, 1, DIM>(v1, seq2 + (size_t)(lo - 1) * dim, hi - lo + 1, dim, cost);
+            cur[lo - 1] = INF;
+            float row_min = INF;
+            for (int j = lo; j <= hi; j++) {
+                cur[j] = cost[j - lo] + std::min({pre[j], cur[j - 1], pre[j - 1]});
+                row_min = std::min(row_min, cur[j]);
+            }
+            if (row_min > bound) {
+                return INF;
+            }
+            std::swap(pre, cur);
+        }
+        return pre[len2];
+    }
+
+    float distance_from_costs(const float* cost, int len1, int len2) const override {
+        const float INF = std::numeric_limits<float>::infinity();
+        float* pre = thread_scratch<SCRATCH_DP>(2 * (len2 + 1));
+        float* cur = pre + len2 + 1;
+        std::fill(pre, pre + 2 * (len2 + 1), INF);
+        pre[0] = 0;
+        for (int i = 1; i <= len1; i++) {
+            int lo, hi;
+            window(i, len1, len2, lo, hi);
+            const float* c = cost + (size_t)(i - 1) * len2;
+            cur[lo - 1] = INF;
+            for (int j = lo; j <= hi; j++) {
+                cur[j] = c[j - 1] + std::min({pre[j], cur[j - 1], pre[j - 1]});
             }
             std::swap(pre, cur);
         }
@@ -71,24 +346,24 @@ public:
     }
 };
 
+template<int DIM = 0>
 class SDTWSpace : public VSSSpace {
 public:
     SDTWSpace(int dim) : VSSSpace(dim, SDTW, new hnswlib::L2Space(dim)) {}
 
     float distance(const float* seq1, int len1, const float* seq2, int len2) const override {
-        const float INF = std::numeric_limits<float>::infinity();
-        std::vector<float> pre(len2 + 1, 0), cur(len2 + 1, 0);
+        return distance_bounded(seq1, len1, seq2, len2, std::numeric_limits<float>::infinity());
+    }
 
-        const float* v1 = seq1;
-        for (int i = 1; i <= len1; i++, v1 += dim) {
-            cur[0] = INF;
-            const float* v2 = seq2;
-            for (int j = 1; j <= len2; j++, v2 += dim) {
-                cur[j] = dist_func(v1, v2, dist_func_param) + std::min({pre[j], cur[j - 1], pre[j - 1]});
-            }
-            std::swap(pre, cur);
+    float distance_bounded(const float* seq1, int len1, const float* seq2, int len2, float bound) const override {
+        if (bound == std::numeric_limits<float>::infinity() && (long)len1 * len2 >= WAVEFRONT_MIN_CELLS) {
+            return dtw_wavefront<true, DIM>(seq1, len1, seq2, len2, dim);
         }
-        return *std::min_element(pre.begin() + 1, pre.end());
+        return dtw_rows<true, DIM>(seq1, len1, seq2, len2, dim, bound);
+    }
+
+    float distance_from_costs(const float* cost, int len1, int len2) const override {
+        return dtw_from_costs<true>(cost, len1, len2);
     }
 };
 
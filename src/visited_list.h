@@ -0,0 +1,77 @@
+#pragma once
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+namespace vss {
+
+// 按轮次标记的访问数组，reset 时只递增 tag，溢出时才清零
+class VisitedList {
+public:
+    typedef unsigned short tag_t;
+
+    size_t num_elements;
+    tag_t tag;
+    tag_t* mass;
+
+    VisitedList(size_t num_elements) : num_elements(num_elements), tag(-1), mass(new tag_t[num_elements]) {
+        memset(mass, 0, sizeof(tag_t) * num_elements);
+    }
+
+    inline void reset() {
+        tag++;
+        if (tag == 0) {
+            tag = 1;
+            memset(mass, 0, sizeof(tag_t) * num_elements);
+        }
+    }
+
+    inline void visit(unsigned int id) { mass[id] = tag; }
+
+    inline bool is_visited(unsigned int id) const { return mass[id] == tag; }
+
+    ~VisitedList() { delete[] mass; }
+};
+
+// 并发查询时每个查询从池中取出一个独占的列表，用完归还，池中列表数量不超过并发度
+template<typename List>
+class ListPool {
+public:
+    size_t num_elements;
+    std::deque<List*> pool;
+    std::mutex pool_lock;
+
+    ListPool(size_t num_elements) : num_elements(num_elements) {}
+
+    List* get() {
+        {
+            std::unique_lock<std::mutex> lock(pool_lock);
+            if (!pool.empty()) {
+                List* list = pool.front();
+                pool.pop_front();
+                return list;
+            }
+        }
+        return new List(num_elements);
+    }
+
+    void release(List* list) {
+        std::unique_lock<std::mutex> lock(pool_lock);
+        pool.push_front(list);
+    }
+
+    size_t size() {
+        std::unique_lock<std::mutex> lock(pool_lock);
+        return pool.size();
+    }
+
+    ~ListPool() {
+        for (List* list : pool) {
+            delete list;
+        }
+    }
+};
+
+typedef ListPool<VisitedList> VisitedListPool;
+
+} // namespace vss
@@ -0,0 +1,171 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "space.h"
+using namespace vss;
+
+// 逐对调用 dist_func、每次分配 DP 行的原始实现，作为对照；CDTW 只计算 window 给出的格子
+float reference_dtw(const VSSSpace* space, const float* seq1, int len1, const float* seq2, int len2) {
+    const float INF = std::numeric_limits<float>::infinity();
+    int dim = space->dim;
+    bool subsequence = space->metric == SDTW;
+    const CDTWSpace<0>* cdtw = dynamic_cast<const CDTWSpace<0>*>(space);
+    std::vector<float> pre(len2 + 1, subsequence ? 0 : INF), cur(len2 + 1, INF);
+    pre[0] = 0;
+
+    const float* v1 = seq1;
+    for (int i = 1; i <= len1; i++, v1 += dim) {
+        int lo = 1, hi = len2;
+        if (cdtw != nullptr) {
+            cdtw->window(i, len1, len2, lo, hi);
+        }
+        cur[0] = INF;
+        const float* v2 = seq2;
+        for (int j = 1; j <= len2; j++, v2 += dim) {
+            if (j < lo || j > hi) {
+                cur[j] = INF;
+                continue;
+            }
+            cur[j] = space->dist_func(v1, v2, space->dist_func_param) + std::min({pre[j], cur[j - 1], pre[j - 1]});
+        }
+        std::swap(pre, cur);
+    }
+    return subsequence ? *std::min_element(pre.begin() + 1, pre.end()) : pre[len2];
+}
+
+float reference_distance(const VSSSpace* space, const float* seq1, int len1, const float* seq2, int len2) {
+    if (space->metric != MAXSIM) {
+        return reference_dtw(space, seq1, len1, seq2, len2);
+    }
+
+    int dim = space->dim;
+    float sum = 0.0f;
+    const float* v1 = seq1;
+    for (int i = 0; i < len1; i++, v1 += dim) {
+        float sim = std::numeric_limits<float>::infinity();
+        const float* v2 = seq2;
+        for (int j = 0; j < len2; j++, v2 += dim) {
+            sim = std::min(sim, space->dist_func(v1, v2, space->dist_func_param));
+        }
+        sum += sim;
+    }
+    return sum;
+}
+
+// cdtw 为 Sakoe-Chiba 带，cdtw-itakura 为 Itakura 平行四边形，半径都为 radius
+template<int DIM>
+VSSSpace* create_space(const std::string& metric_name, int dim, int radius) {
+    if (metric_name == "maxsim") {
+        return new MaxSimSpace<DIM>(dim);
+    } else if (metric_name == "dtw") {
+        return new DTWSpace<DIM>(dim);
+    } else if (metric_name == "sdtw") {
+        return new SDTWSpace<DIM>(dim);
+    } else if (metric_name == "cdtw") {
+        return new CDTWSpace<DIM>(dim, radius, SAKOE_CHIBA);
+    } else if (metric_name == "cdtw-itakura") {
+        return new CDTWSpace<DIM>(dim, radius, ITAKURA);
+    }
+    return nullptr;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <dim> <similarity_metric> [len1] [len2] [seq_num] [radius]\n";
+        return 1;
+    }
+
+    int dim = std::stoi(argv[1]);
+    std::string metric_name = argv[2];
+    int len1 = argc > 3 ? std::stoi(argv[3]) : 32;
+    int len2 = argc > 4 ? std::stoi(argv[4]) : 128;
+    int seq_num = argc > 5 ? std::stoi(argv[5]) : 1000;
+    int radius = argc > 6 ? std::stoi(argv[6]) : 8;
+
+    VSSSpace* space = create_space<0>(metric_name, dim, radius);
+    VSSSpace* static_space = nullptr;
+    switch (dim) {
+    case 128:
+        static_space = create_space<128>(metric_name, dim, radius);
+        break;
+    case 384:
+        static_space = create_space<384>(metric_name, dim, radius);
+        break;
+    case 768:
+        static_space = create_space<768>(metric_name, dim, radius);
+        break;
+    case 1024:
+        static_space = create_space<1024>(metric_name, dim, radius);
+        break;
+    }
+    if (space == nullptr) {
+        std::cerr << "Unknown similarity metric: " << metric_name << std::endl;
+        return 1;
+    }
+
+    std::mt19937 rng(100);
+    std::normal_distribution<float> normal;
+    auto random_seq = [&](int len) {
+        std::vector<float> seq(len * dim);
+        for (int i = 0; i < len; i++) {
+            float norm = 0.0f;
+            for (int j = 0; j < dim; j++) {
+                seq[i * dim + j] = normal(rng);
+                norm += seq[i * dim + j] * seq[i * dim + j];
+            }
+            norm = std::sqrt(norm);
+            for (int j = 0; j < dim; j++) {
+                seq[i * dim + j] /= norm;
+            }
+        }
+        return seq;
+    };
+
+    std::vector<float> query = random_seq(len1);
+    std::vector<float> base = random_seq(len2 * seq_num);
+
+    auto bench = [&](const std::string& name, auto&& dist) {
+        float checksum = 0.0f;
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < seq_num; i++) {
+            checksum += dist(query.data(), len1, base.data() + (size_t)i * len2 * dim, len2);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double time = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / 1000.0;
+        std::cout << name << ": " << time / seq_num << " us/call, checksum " << checksum << std::endl;
+        return time;
+    };
+
+    // 与对照实现逐个比较，报告最大相对误差
+    float max_error = 0.0f;
+    for (int i = 0; i < std::min(seq_num, 100); i++) {
+        const float* seq2 = base.data() + (size_t)i * len2 * dim;
+        float ref = reference_distance(space, query.data(), len1, seq2, len2);
+        float dist = space->distance(query.data(), len1, seq2, len2);
+        max_error = std::max(max_error, std::fabs(dist - ref) / std::max(std::fabs(ref), 1e-6f));
+    }
+    std::cout << "Max relative error vs reference: " << max_error << std::endl;
+
+    double ref_time = bench("reference", [&](const float* seq1, int len1, const float* seq2, int len2) {
+        return reference_distance(space, seq1, len1, seq2, len2);
+    });
+    double time = bench("kernel", [&](const float* seq1, int len1, const float* seq2, int len2) {
+        return space->distance(seq1, len1, seq2, len2);
+    });
+    std::cout << "Speedup: " << ref_time / time << std::endl;
+
+    if (static_space != nullptr) {
+        double static_time = bench("kernel (static dim)", [&](const float* seq1, int len1, const float* seq2, int len2) {
+            return static_space->distance(seq1, len1, seq2, len2);
+        });
+        std::cout << "Speedup (static dim): " << ref_time / static_time << ", " << time / static_time << std::endl;
+        delete static_space;
+    }
+
+    delete space;
+    return 0;
+}
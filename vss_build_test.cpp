@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "baselines/multi_hnsw_index.h"
+#include "baselines/single_hnsw_index.h"
+#include "dataset.h"
+#include "space.h"
+using namespace vss;
+
+// seg 批同步构建的图与线程数无关：两次 4 线程构建和单线程构建的邻接表应完全相同；
+// single_hnsw 并发插入的图不可复现，只检查多线程构建的 token 召回率不明显低于单线程构建；
+// 最后检查 seg 的在线更新：删除、修复、扩容插入以及保存加载后的删除标记
+const int DIM = 32;
+const int SEQ_NUM = 2000;
+const int QUERY_NUM = 50;
+const int K = 10;
+const int EF = 64;
+const int THREADS = 4;
+const int TOKEN_EF = 16;
+const float TOLERANCE = 0.03f;
+
+// 以若干簇心加噪声生成单位向量序列，写成 fvecs / lens 文件供 VSSDataset 读取
+void write_dataset(const fs::path& dir, const std::string& name, int seq_num, std::mt19937& rng,
+                   const std::vector<float>& centers) {
+    std::normal_distribution<float> normal;
+    std::uniform_int_distribution<int> len_dist(4, 12);
+    std::uniform_int_distribution<int> center_dist(0, centers.size() / DIM - 1);
+
+    std::ofstream vec_out(dir / (name + ".fvecs"), std::ios::binary);
+    std::ofstream len_out(dir / (name + ".lens"), std::ios::binary);
+    std::vector<float> vec(DIM);
+    for (int i = 0; i < seq_num; i++) {
+        int len = len_dist(rng);
+        len_out.write((const char*)&len, 4);
+        for (int j = 0; j < len; j++) {
+            const float* center = centers.data() + (size_t)center_dist(rng) * DIM;
+            float norm = 0.0f;
+            for (int d = 0; d < DIM; d++) {
+                vec[d] = center[d] + 0.3f * normal(rng);
+                norm += vec[d] * vec[d];
+            }
+            norm = std::sqrt(norm);
+            for (int d = 0; d < DIM; d++) {
+                vec[d] /= norm;
+            }
+            int dim = DIM;
+            vec_out.write((const char*)&dim, 4);
+            vec_out.write((const char*)vec.data(), DIM * 4);
+        }
+    }
+}
+
+MultiHNSWIndex* build_seg(VSSSpace* space, const VSSDataset* base, int build_threads) {
+    MultiHNSWIndex* index = new MultiHNSWIndex(DIM, space, 16, 200);
+    index->build_threads = build_threads;
+    index->build(base);
+    return index;
+}
+
+float recall(VSSIndex* index, const VSSDataset* query, const std::vector<std::vector<int>>& truth) {
+    int hit = 0;
+    for (int i = 0; i < query->seq_num; i++) {
+        auto res = index->search(query->seq_data[i], query->seq_len[i], K, EF);
+        while (!res.empty()) {
+            hit += std::count(truth[i].begin(), truth[i].end(), res.top().second);
+            res.pop();
+        }
+    }
+    return (float)hit / (query->seq_num * K);
+}
+
+// 入口点、层数和每层邻接表逐个比较
+bool same_graph(const MultiHNSW* a, const MultiHNSW* b) {
+    if (a->cur_elements != b->cur_elements || a->enterpoint != b->enterpoint || a->max_level != b->max_level) {
+        return false;
+    }
+    for (id_t id = 0; id < a->cur_elements; id++) {
+        if (a->element_levels[id] != b->element_levels[id]) {
+            return false;
+        }
+        for (int level = 0; level <= a->element_levels[id]; level++) {
+            linklist_t* ll_a = a->addr_linklist(id, level);
+            linklist_t* ll_b = b->addr_linklist(id, level);
+            int size = a->get_ll_size(ll_a);
+            if (size != b->get_ll_size(ll_b) ||
+                !std::equal(a->get_ll_neighbors(ll_a), a->get_ll_neighbors(ll_a) + size, b->get_ll_neighbors(ll_b))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 查询序列各 token 在 base 全部向量上的 top-K 召回率，真值暴力计算
+float token_recall(VSSSpace* space, const VSSDataset* base, const VSSDataset* query, int build_threads) {
+    SingleHNSWIndex index(DIM, space, 16, 200);
+    index.build_threads = build_threads;
+    index.build(base);
+
+    int hit = 0;
+    for (int i = 0; i < query->size; i++) {
+        const float* q = query->data + (size_t)i * DIM;
+        std::priority_queue<std::pair<float, size_t>> truth;
+        for (int j = 0; j < base->size; j++) {
+            truth.emplace(space->dist_func(q, base->data + (size_t)j * DIM, space->dist_func_param), j);
+            if ((int)truth.size() > K) {
+                truth.pop();
+            }
+        }
+        std::vector<size_t> ids;
+        while (!truth.empty()) {
+            ids.push_back(truth.top().second);
+            truth.pop();
+        }
+        auto res = index.hnsw->search_knn(q, K, TOKEN_EF);
+        while (!res.empty()) {
+            hit += std::count(ids.begin(), ids.end(), res.top().second);
+            res.pop();
+        }
+    }
+    return (float)hit / ((size_t)query->size * K);
+}
+
+// 只在存活序列中暴力计算 top-K
+std::vector<std::vector<int>> live_truth(VSSSpace* space, const VSSDataset* base, const VSSDataset* query,
+                                        const std::vector<char>& live) {
+    std::vector<std::vector<int>> truth(query->seq_num);
+    for (int i = 0; i < query->seq_num; i++) {
+        std::priority_queue<std::pair<float, int>> res;
+        for (int j = 0; j < base->seq_num; j++) {
+            if (!live[j]) {
+                continue;
+            }
+            res.emplace(space->distance(query->seq_data[i], query->seq_len[i], base->seq_data[j], base->seq_len[j]), j);
+            if ((int)res.size() > K) {
+                res.pop();
+            }
+        }
+        while (!res.empty()) {
+            truth[i].push_back(res.top().second);
+            res.pop();
+        }
+    }
+    return truth;
+}
+
+// 查询结果中出现已删除序列的次数
+int deleted_returned(VSSIndex* index, const VSSDataset* query, const std::vector<char>& live) {
+    int count = 0;
+    for (int i = 0; i < query->seq_num; i++) {
+        auto res = index->search(query->seq_data[i], query->seq_len[i], K, EF);
+        while (!res.empty()) {
+            count += !live[res.top().second];
+            res.pop();
+        }
+    }
+    return count;
+}
+
+// 先用前 80% 的序列构建，删除其中每 4 个中的 1 个，修复后逐个插入其余序列（超出容量时扩容），
+// 再保存、加载并继续插入
+bool test_updates(VSSSpace* space, const VSSDataset* base, const VSSDataset* query, const fs::path& dir) {
+    bool ok = true;
+    int num = base->seq_num * 4 / 5;
+    std::vector<char> live(base->seq_num, 0);
+    std::fill(live.begin(), live.begin() + num, 1);
+
+    MultiHNSWIndex* index = new MultiHNSWIndex(DIM, space, 16, 200);
+    index->build_threads = THREADS;
+    index->build_prefix(base, num);
+    for (int id = 0; id < num; id += 4) {
+        index->remove(id);
+        live[id] = 0;
+    }
+    auto truth = live_truth(space, base, query, live);
+    float before = recall(index, query, truth);
+    int returned_before = deleted_returned(index, query, live);
+    index->repair();
+    float after = recall(index, query, truth);
+    int returned_after = deleted_returned(index, query, live);
+    std::cout << "seg recall after deletes: " << before << ", after repair: " << after << std::endl;
+    if (returned_before > 0 || returned_after > 0) {
+        std::cerr << "Deleted sequences returned: " << returned_before << " before repair, " << returned_after
+                  << " after" << std::endl;
+        ok = false;
+    }
+    if (after < before - TOLERANCE) {
+        std::cerr << "seg recall dropped by more than " << TOLERANCE << " after repair" << std::endl;
+        ok = false;
+    }
+
+    for (int i = num; i < base->seq_num; i++) {
+        if (index->insert(base->seq_data[i], base->seq_len[i]) != i) {
+            std::cerr << "Insert returned an unexpected id for sequence " << i << std::endl;
+            ok = false;
+            break;
+        }
+        live[i] = 1;
+    }
+    truth = live_truth(space, base, query, live);
+    std::cout << "seg recall after inserts: " << recall(index, query, truth) << std::endl;
+
+    std::string path = (dir / "seg.index").string();
+    index->save(path);
+    size_t num_deleted = index->hnsw->num_deleted;
+    delete index;
+
+    index = new MultiHNSWIndex(DIM, space, 16, 200);
+    if (!index->load(path, base)) {
+        std::cerr << "Fail to load the saved seg index" << std::endl;
+        delete index;
+        return false;
+    }
+    bool tombstones = index->hnsw->num_deleted == num_deleted;
+    for (int id = 0; id < base->seq_num; id++) {
+        tombstones = tombstones && (index->hnsw->element_deleted[id] != 0) == !live[id];
+    }
+    if (!tombstones || deleted_returned(index, query, live) > 0) {
+        std::cerr << "Reloaded seg index lost its tombstones" << std::endl;
+        ok = false;
+    }
+
+    // 加载后容量即已有元素数，再插入会扩容；插入的序列应能被自身检索到
+    for (int i = 0; i < 10; i++) {
+        int id = index->insert(base->seq_data[i], base->seq_len[i]);
+        auto res = index->search(base->seq_data[i], base->seq_len[i], K, EF);
+        bool found = false;
+        while (!res.empty()) {
+            found = found || res.top().second == id;
+            res.pop();
+        }
+        if (id != base->seq_num + i || !found) {
+            std::cerr << "Insert after reload failed for sequence " << i << std::endl;
+            ok = false;
+            break;
+        }
+    }
+    delete index;
+    return ok;
+}
+
+int main() {
+    fs::path dir = fs::temp_directory_path() / "vss_build_test";
+    fs::create_directories(dir);
+
+    std::mt19937 rng(100);
+    std::normal_distribution<float> normal;
+    std::vector<float> centers(64 * DIM);
+    for (float& x : centers) {
+        x = normal(rng);
+    }
+    write_dataset(dir, "base", SEQ_NUM, rng, centers);
+    write_dataset(dir, "query", QUERY_NUM, rng, centers);
+
+    VSSDataset base(DIM, dir / "base.fvecs", dir / "base.lens");
+    VSSDataset query(DIM, dir / "query.fvecs", dir / "query.lens");
+    VSSSpace* space = new MaxSimSpace<0>(DIM);
+
+    // 暴力计算真实 top-K
+    std::vector<std::vector<int>> truth(query.seq_num);
+    for (int i = 0; i < query.seq_num; i++) {
+        std::priority_queue<std::pair<float, int>> res;
+        for (int j = 0; j < base.seq_num; j++) {
+            res.emplace(space->distance(query.seq_data[i], query.seq_len[i], base.seq_data[j], base.seq_len[j]), j);
+            if ((int)res.size() > K) {
+                res.pop();
+            }
+        }
+        while (!res.empty()) {
+            truth[i].push_back(res.top().second);
+            res.pop();
+        }
+    }
+
+    bool ok = true;
+    MultiHNSWIndex* serial = build_seg(space, &base, 1);
+    MultiHNSWIndex* threaded1 = build_seg(space, &base, THREADS);
+    MultiHNSWIndex* threaded2 = build_seg(space, &base, THREADS);
+    std::cout << "seg recall (1 thread): " << recall(serial, &query, truth) << std::endl;
+    if (!same_graph(threaded1->hnsw, threaded2->hnsw)) {
+        std::cerr << "Two " << THREADS << "-thread seg builds differ" << std::endl;
+        ok = false;
+    }
+    if (!same_graph(serial->hnsw, threaded1->hnsw)) {
+        std::cerr << THREADS << "-thread seg build differs from the 1-thread build" << std::endl;
+        ok = false;
+    }
+    delete serial;
+    delete threaded1;
+    delete threaded2;
+
+    float token_serial = token_recall(space, &base, &query, 1);
+    float token_threaded = token_recall(space, &base, &query, THREADS);
+    std::cout << "single_hnsw token recall (1 thread): " << token_serial << std::endl;
+    std::cout << "single_hnsw token recall (" << THREADS << " threads): " << token_threaded << std::endl;
+    if (token_threaded < token_serial - TOLERANCE) {
+        std::cerr << "Threaded single_hnsw build recall dropped by more than " << TOLERANCE << std::endl;
+        ok = false;
+    }
+
+    ok = test_updates(space, &base, &query, dir) && ok;
+
+    delete space;
+    fs::remove_all(dir);
+    return ok ? 0 : 1;
+}
@@ -2,12 +2,30 @@
 using namespace vss;
 
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " <dim> <similarity_metric> <data_dir> <index_name>\n";
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " <dim> <similarity_metric> <data_dir> <index_name> [option=value ...]\n";
         return 1;
     }
 
-    VSSRunner runner(std::stoi(argv[1]), argv[2], argv[3], argv[4]);
+    std::unordered_map<std::string, std::string> options;
+    for (int i = 5; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t pos = arg.find('=');
+        if (pos == std::string::npos) {
+            std::cerr << "Invalid option: " << arg << ", expected option=value\n";
+            return 1;
+        }
+        options[arg.substr(0, pos)] = arg.substr(pos + 1);
+    }
+
+    VSSRunner runner(std::stoi(argv[1]), argv[2], argv[3], argv[4], options);
+    // mixed=<轮数> 时跑 seg 索引的插入/删除/查询混合负载
+    int mixed_rounds = runner.get_option("mixed", 0);
+    if (mixed_rounds > 0) {
+        runner.run_mixed(mixed_rounds);
+        return 0;
+    }
+
     runner.run_build();
     runner.run_search();
 